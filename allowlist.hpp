@@ -0,0 +1,133 @@
+/*
+
+Copyright (c) 2013, Daniel S. Standage <daniel.standage@gmail.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#ifndef SMR_ALLOWLIST_HPP
+#define SMR_ALLOWLIST_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "counttable.hpp"
+#include "sketch.hpp"
+
+// Bits per 64-byte block of the Bloom filter, and bits set per ID
+#define SMR_BLOOM_BLOCK  512
+#define SMR_BLOOM_PROBES 4
+
+
+/**
+ * @type BloomFilter
+ *
+ * Blocked Bloom filter: an ID's hash selects one cache-line sized block, and
+ * SMR_BLOOM_PROBES bits within that block, so a lookup costs at most one cache
+ * miss. With 16 bits per ID, about 1 in 200 absent IDs is let through.
+ */
+typedef struct BloomFilter BloomFilter;
+struct BloomFilter
+{
+  std::vector<uint64_t> bits;
+  size_t blockmask;
+
+  BloomFilter(size_t capacity)
+  {
+    size_t numblocks = 1;
+    while(numblocks * SMR_BLOOM_BLOCK < capacity * 16)
+      numblocks <<= 1;
+    blockmask = numblocks - 1;
+    bits.assign(numblocks * (SMR_BLOOM_BLOCK / 64), 0);
+  }
+
+  uint64_t *block(uint64_t h)
+  {
+    return &bits[(h & blockmask) * (SMR_BLOOM_BLOCK / 64)];
+  }
+
+  const uint64_t *block(uint64_t h) const
+  {
+    return &bits[(h & blockmask) * (SMR_BLOOM_BLOCK / 64)];
+  }
+
+  void insert(uint64_t h)
+  {
+    uint64_t *words = block(h);
+    uint64_t probes = smr_mix(h);
+    for(unsigned i = 0; i < SMR_BLOOM_PROBES; i++, probes >>= 9)
+      words[(probes >> 6) & 7] |= 1ULL << (probes & 63);
+  }
+
+  bool contains(uint64_t h) const
+  {
+    const uint64_t *words = block(h);
+    uint64_t probes = smr_mix(h);
+    for(unsigned i = 0; i < SMR_BLOOM_PROBES; i++, probes >>= 9)
+    {
+      if(!(words[(probes >> 6) & 7] & (1ULL << (probes & 63))))
+        return false;
+    }
+    return true;
+  }
+};
+
+
+/**
+ * @type IdAllowlist
+ *
+ * The molecule IDs to count, in the order given. Reads mapped anywhere else
+ * are dropped before they reach a count table: most are rejected by the Bloom
+ * filter, and the few it lets through are checked against the exact set.
+ */
+typedef struct IdAllowlist IdAllowlist;
+struct IdAllowlist
+{
+  std::vector<char> names;
+  std::vector<size_t> starts;
+  CountTable exact;  // ID -> position in the list + 1
+  BloomFilter bloom;
+
+  // `ids` holds NUL-terminated IDs back to back; repeats are ignored
+  IdAllowlist(const std::vector<char>& ids) : bloom(0)
+  {
+    size_t count = 0;
+    for(size_t i = 0; i < ids.size(); i += strlen(&ids[i]) + 1)
+      count++;
+    bloom = BloomFilter(count);
+    for(size_t i = 0; i < ids.size(); i += strlen(&ids[i]) + 1)
+    {
+      const char *molid = &ids[i];
+      size_t len = strlen(molid);
+      uint64_t h = smr_hash(molid, len);
+      if(exact.find(molid, len, h) != 0)
+        continue;
+      starts.push_back(names.size());
+      names.insert(names.end(), molid, molid + len + 1);
+      exact.increment(molid, len, h, starts.size());
+      bloom.insert(h);
+    }
+  }
+
+  size_t size() const { return starts.size(); }
+  const char *operator[](size_t i) const { return &names[starts[i]]; }
+
+  bool contains(const char *molid, size_t len) const
+  {
+    uint64_t h = smr_hash(molid, len);
+    return bloom.contains(h) && exact.find(molid, len, h) != 0;
+  }
+};
+
+#endif
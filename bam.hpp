@@ -0,0 +1,284 @@
+/*
+
+Copyright (c) 2013, Daniel S. Standage <daniel.standage@gmail.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#ifndef SMR_BAM_HPP
+#define SMR_BAM_HPP
+
+#include <zlib.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+#include "bgzf.hpp"
+#include "blockreader.hpp"
+
+// The bin of a .bai index that holds metadata rather than chunks
+#define SMR_BAI_PSEUDO_BIN 37450
+
+
+/**
+ * @type BgzfReader
+ *
+ * Reads the uncompressed stream of a BGZF file one block at a time, starting
+ * from any virtual offset: the file offset of a block shifted left 16 bits,
+ * plus an offset into the block once it is inflated. Blocks are read with
+ * pread, so readers of different ranges of one file share nothing. A block
+ * that is not BGZF, does not inflate or cannot be read sets `corrupt` and
+ * ends the stream.
+ */
+typedef struct BgzfReader BgzfReader;
+struct BgzfReader
+{
+  int fd;
+  uint64_t offset;  // file offset of the current block
+  uint64_t next;    // file offset of the block after it
+  std::vector<unsigned char> compressed;
+  std::vector<char> block;
+  size_t length;    // bytes inflated from the current block
+  size_t pos;
+  bool corrupt;
+  z_stream zs;
+
+  BgzfReader(int fd)
+    : fd(fd), offset(0), next(0), compressed(SMR_BGZF_MAX_BLOCK),
+      block(SMR_BGZF_MAX_BLOCK), length(0), pos(0), corrupt(false)
+  {
+    memset(&zs, 0, sizeof(zs));
+    inflateInit2(&zs, -15);
+  }
+
+  ~BgzfReader()
+  {
+    inflateEnd(&zs);
+  }
+
+  BgzfReader(const BgzfReader&) = delete;
+  BgzfReader& operator=(const BgzfReader&) = delete;
+
+  // Virtual offset of the next byte to be read
+  uint64_t tell() const
+  {
+    return pos < length ? offset << 16 | pos : next << 16;
+  }
+
+  // Move to virtual offset `voffset`; returns false if there is no block there
+  bool seek(uint64_t voffset)
+  {
+    if(!load(voffset >> 16))
+      return false;
+    pos = voffset & 0xffff;
+    return pos <= length;
+  }
+
+  // Inflate the block at file offset `at`; returns false at the end of the
+  // file or if the block is corrupt or cannot be read
+  bool load(uint64_t at)
+  {
+    char *header = (char *)compressed.data();
+    ssize_t len = smr_pread_full(fd, header, 18, at);
+    if(len == 0)
+      return false;
+    const unsigned char *h = compressed.data();
+    if(len < 18 || h[0] != 31 || h[1] != 139 || h[2] != 8 ||
+       (h[3] & 4) == 0 || h[10] != 6 || h[11] != 0 || h[12] != 'B' ||
+       h[13] != 'C' || h[14] != 2 || h[15] != 0)
+    {
+      corrupt = true;
+      return false;
+    }
+    size_t size = (h[16] | h[17] << 8) + 1;
+    if(size < 26 ||
+       smr_pread_full(fd, header + 18, size - 18, at + 18) !=
+       (ssize_t)(size - 18))
+    {
+      corrupt = true;
+      return false;
+    }
+    inflateReset(&zs);
+    zs.next_in = compressed.data() + 18;
+    zs.avail_in = size - 26;
+    zs.next_out = (unsigned char *)block.data();
+    zs.avail_out = block.size();
+    if(inflate(&zs, Z_FINISH) != Z_STREAM_END)
+    {
+      corrupt = true;
+      return false;
+    }
+    length = zs.total_out;
+    offset = at;
+    next = at + size;
+    pos = 0;
+    return true;
+  }
+
+  // Copy the next `n` bytes to `data`; returns false if the stream ends first
+  bool read(void *data, size_t n)
+  {
+    char *out = (char *)data;
+    while(n > 0)
+    {
+      if(pos == length && !load(next))
+        return false;
+      size_t len = std::min(n, length - pos);
+      memcpy(out, &block[pos], len);
+      pos += len;
+      out += len;
+      n -= len;
+    }
+    return true;
+  }
+};
+
+
+/**
+ * @type BamHeader
+ *
+ * The reference list of a BAM file: the name and length of each molecule,
+ * indexed by the reference ID that alignment records use in place of RNAME.
+ * The SAM header text before it is skipped, as the list is what BAM readers
+ * go by.
+ */
+typedef struct BamHeader BamHeader;
+struct BamHeader
+{
+  std::vector<std::string> names;
+  std::vector<uint64_t> lengths;
+
+  // Read the header from the start of `reader`'s stream; returns false if it
+  // is not BAM
+  bool read(BgzfReader& reader)
+  {
+    char magic[4];
+    uint32_t textlen, numrefs;
+    if(!reader.seek(0) || !reader.read(magic, 4) ||
+       memcmp(magic, "BAM\1", 4) != 0 || !reader.read(&textlen, 4))
+      return false;
+    std::vector<char> text(textlen);
+    if(!reader.read(text.data(), textlen) || !reader.read(&numrefs, 4))
+      return false;
+    for(uint32_t r = 0; r < numrefs; r++)
+    {
+      uint32_t namelen, length;
+      if(!reader.read(&namelen, 4) || namelen == 0 || namelen >= (1 << 24))
+        return false;
+      std::string name(namelen, '\0');
+      if(!reader.read(&name[0], namelen) || !reader.read(&length, 4))
+        return false;
+      name.resize(namelen - 1);
+      names.push_back(name);
+      lengths.push_back(length);
+    }
+    return true;
+  }
+};
+
+
+/**
+ * @type BamRecord
+ *
+ * The fields of a BAM alignment record that counting needs, read in place
+ * from the record's bytes (after its block_size field).
+ */
+typedef struct BamRecord BamRecord;
+struct BamRecord
+{
+  int32_t refid;
+  uint16_t flag;
+  const char *qname;
+  size_t qnamelen;
+
+  // Returns false if the record is too short to hold these fields
+  bool parse(const char *data, size_t len)
+  {
+    if(len < 32)
+      return false;
+    uint8_t namelen = data[8];
+    memcpy(&refid, data, 4);
+    memcpy(&flag, data + 14, 2);
+    qname = data + 32;
+    qnamelen = namelen > 0 ? namelen - 1 : 0;
+    return 32 + (size_t)namelen <= len;
+  }
+};
+
+
+/**
+ * @type BamIndex
+ *
+ * What counting needs of a .bai index: for each reference, the span of
+ * virtual offsets that holds its alignments, from the start of its first
+ * chunk to the end of its last one. In a coordinate-sorted BAM the records of
+ * a reference are contiguous, so the span holds all of them and (at its ends)
+ * at most a few records of its neighbours.
+ */
+typedef struct BamIndex BamIndex;
+struct BamIndex
+{
+  typedef std::pair<uint64_t, uint64_t> Span;
+  std::vector<Span> spans;  // [begin, end); begin == end for no alignments
+
+  // Read the index at `path`; returns false if there is none, or if it is
+  // not a complete index
+  bool load(const std::string& path)
+  {
+    FILE *in = fopen(path.c_str(), "rb");
+    if(in == NULL)
+      return false;
+    char magic[4];
+    int32_t numrefs;
+    bool valid = fread(magic, 1, 4, in) == 4 &&
+                 memcmp(magic, "BAI\1", 4) == 0 &&
+                 fread(&numrefs, 4, 1, in) == 1 && numrefs >= 0;
+    for(int32_t r = 0; valid && r < numrefs; r++)
+    {
+      Span span(UINT64_MAX, 0);
+      int32_t numbins;
+      valid = fread(&numbins, 4, 1, in) == 1 && numbins >= 0;
+      for(int32_t b = 0; valid && b < numbins; b++)
+      {
+        uint32_t bin;
+        int32_t numchunks;
+        valid = fread(&bin, 4, 1, in) == 1 &&
+                fread(&numchunks, 4, 1, in) == 1 && numchunks >= 0;
+        std::vector<uint64_t> chunks(valid ? 2 * numchunks : 0);
+        valid = valid && fread(chunks.data(), 8, chunks.size(), in) ==
+                         chunks.size();
+        for(size_t c = 0; valid && bin != SMR_BAI_PSEUDO_BIN &&
+                          c < chunks.size(); c += 2)
+        {
+          span.first = std::min(span.first, chunks[c]);
+          span.second = std::max(span.second, chunks[c + 1]);
+        }
+      }
+      int32_t numintervals;
+      valid = valid && fread(&numintervals, 4, 1, in) == 1 &&
+              numintervals >= 0 &&
+              fseek(in, 8L * numintervals, SEEK_CUR) == 0;
+      if(span.first >= span.second)
+        span = Span(0, 0);
+      spans.push_back(span);
+    }
+    fclose(in);
+    return valid;
+  }
+};
+
+#endif
@@ -0,0 +1,248 @@
+/*
+
+Copyright (c) 2013, Daniel S. Standage <daniel.standage@gmail.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#ifndef SMR_BGZF_HPP
+#define SMR_BGZF_HPP
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Uncompressed bytes per block; a deflated block of this size, even of
+// incompressible data, fits in the 64 KB limit of a BGZF block
+#define SMR_BGZF_BLOCK_SIZE 0xff00
+#define SMR_BGZF_MAX_BLOCK  0x10000
+
+
+/**
+ * @type BgzfWriter
+ *
+ * Writes BGZF, the blocked gzip format of samtools and tabix, which any gzip
+ * reader can also decompress. Text is cut into blocks of SMR_BGZF_BLOCK_SIZE
+ * bytes that are deflated independently on `numthreads` threads, as pigz
+ * does, and written to the file in order by whichever thread finishes the
+ * next block due. At most two blocks per thread are in flight; write() waits
+ * for room, so a fast producer cannot run ahead of compression. Errors
+ * writing the file are fatal.
+ */
+typedef struct BgzfWriter BgzfWriter;
+struct BgzfWriter
+{
+  struct Block
+  {
+    size_t seq;
+    std::vector<char> data;
+  };
+
+  int fd;
+  std::vector<char> pending;
+  size_t nextseq;
+  size_t nextwrite;
+  size_t inflight;
+  size_t maxinflight;
+  std::deque<Block> queue;
+  std::map<size_t, std::vector<char> > finished;
+  std::vector<std::thread> threads;
+  std::mutex lock;
+  std::mutex writelock;
+  std::condition_variable ready;
+  std::condition_variable room;
+  bool stopping;
+
+  BgzfWriter(int fd, unsigned numthreads)
+    : fd(fd), nextseq(0), nextwrite(0), inflight(0),
+      maxinflight(2 * std::max(numthreads, 1u)), stopping(false)
+  {
+    pending.reserve(SMR_BGZF_BLOCK_SIZE);
+    for(unsigned i = 0; i < std::max(numthreads, 1u); i++)
+      threads.emplace_back(&BgzfWriter::work, this);
+  }
+
+  ~BgzfWriter()
+  {
+    if(!threads.empty())
+      close();
+  }
+
+  void write(const char *data, size_t len)
+  {
+    while(len > 0)
+    {
+      size_t n = std::min(len, SMR_BGZF_BLOCK_SIZE - pending.size());
+      pending.insert(pending.end(), data, data + n);
+      data += n;
+      len -= n;
+      if(pending.size() == SMR_BGZF_BLOCK_SIZE)
+        submit();
+    }
+  }
+
+  // Compress what is left, wait for every block to be written, and end the
+  // file with the empty block that marks a complete BGZF file
+  void close()
+  {
+    if(!pending.empty())
+      submit();
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      room.wait(guard, [this] { return inflight == 0; });
+      stopping = true;
+    }
+    ready.notify_all();
+    for(auto& thread : threads)
+      thread.join();
+    threads.clear();
+    std::vector<char> eof;
+    compress(NULL, 0, eof);
+    write_fully(eof);
+  }
+
+  void submit()
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    room.wait(guard, [this] { return inflight < maxinflight; });
+    inflight++;
+    queue.push_back(Block{nextseq++, std::vector<char>()});
+    queue.back().data.swap(pending);
+    guard.unlock();
+    ready.notify_one();
+    pending.reserve(SMR_BGZF_BLOCK_SIZE);
+  }
+
+  void work()
+  {
+    std::vector<char> out;
+    while(true)
+    {
+      Block block;
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        ready.wait(guard, [this] { return stopping || !queue.empty(); });
+        if(queue.empty())
+          return;
+        block = std::move(queue.front());
+        queue.pop_front();
+      }
+      compress(block.data.data(), block.data.size(), out);
+
+      // Write this block and any later ones already waiting, in order. The
+      // write lock is taken before the block is filed, so the thread holding
+      // it sees every block finished before it checks.
+      std::lock_guard<std::mutex> writing(writelock);
+      size_t written = 0;
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        finished[block.seq].swap(out);
+      }
+      while(true)
+      {
+        std::vector<char> next;
+        {
+          std::lock_guard<std::mutex> guard(lock);
+          auto first = finished.find(nextwrite);
+          if(first == finished.end())
+            break;
+          next.swap(first->second);
+          finished.erase(first);
+          nextwrite++;
+        }
+        write_fully(next);
+        written++;
+      }
+      if(written > 0)
+      {
+        {
+          std::lock_guard<std::mutex> guard(lock);
+          inflight -= written;
+        }
+        room.notify_all();
+      }
+    }
+  }
+
+  // Deflate `len` bytes into one BGZF block: a gzip member whose extra field
+  // records the size of the whole member
+  static void compress(const char *data, size_t len, std::vector<char>& out)
+  {
+    static const unsigned char header[18] = {
+      0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0, 0, 0
+    };
+    out.resize(SMR_BGZF_MAX_BLOCK);
+    memcpy(out.data(), header, sizeof(header));
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if(deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                    Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+      fputs("error: unable to initialize compression\n", stderr);
+      exit(1);
+    }
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = len;
+    zs.next_out = (Bytef *)out.data() + sizeof(header);
+    zs.avail_out = out.size() - sizeof(header) - 8;
+    if(deflate(&zs, Z_FINISH) != Z_STREAM_END)
+    {
+      fputs("error: compressed block does not fit in a BGZF block\n", stderr);
+      exit(1);
+    }
+    size_t size = sizeof(header) + zs.total_out + 8;
+    deflateEnd(&zs);
+
+    uint32_t crc = crc32(crc32(0L, Z_NULL, 0), (const Bytef *)data, len);
+    unsigned char *p = (unsigned char *)out.data();
+    p[16] = (size - 1) & 0xff;
+    p[17] = (size - 1) >> 8;
+    for(int i = 0; i < 4; i++)
+    {
+      p[size - 8 + i] = (crc >> (8 * i)) & 0xff;
+      p[size - 4 + i] = ((uint32_t)len >> (8 * i)) & 0xff;
+    }
+    out.resize(size);
+  }
+
+  void write_fully(const std::vector<char>& data)
+  {
+    size_t done = 0;
+    while(done < data.size())
+    {
+      ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+      if(n < 0 && errno == EINTR)
+        continue;
+      if(n <= 0)
+      {
+        fprintf(stderr, "error writing compressed output: %s\n",
+                strerror(errno));
+        exit(1);
+      }
+      done += n;
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,454 @@
+/*
+
+Copyright (c) 2013, Daniel S. Standage <daniel.standage@gmail.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#ifndef SMR_BLOCKREADER_HPP
+#define SMR_BLOCKREADER_HPP
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "smr.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define SMR_HAVE_IO_URING 1
+#endif
+#endif
+
+
+/**
+ * @type BlockReaderOptions
+ *
+ * How a BlockReader reads a file: the number of reads kept in flight, the size
+ * of each read, the I/O engine, and whether to drop consumed pages from the
+ * page cache.
+ */
+typedef struct BlockReaderOptions BlockReaderOptions;
+struct BlockReaderOptions
+{
+  unsigned depth;
+  size_t blocksize;
+  int engine;
+  bool dropcache;
+
+  BlockReaderOptions() : depth(4), blocksize(1 << 20), engine(SMR_IO_AUTO),
+                         dropcache(false) {}
+};
+
+
+// Read `len` bytes at `offset`, retrying short reads; returns the number of
+// bytes read, which is less than `len` only at the end of the file, or -1
+// with errno set if a read fails.
+static inline ssize_t smr_pread_full(int fd, char *buffer, size_t len,
+                                     off_t offset)
+{
+  size_t done = 0;
+  while(done < len)
+  {
+    ssize_t n = pread(fd, buffer + done, len - done, offset + done);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n < 0)
+      return -1;
+    if(n == 0)
+      break;
+    done += n;
+  }
+  return done;
+}
+
+
+#ifdef SMR_HAVE_IO_URING
+/**
+ * @type UringQueue
+ *
+ * Minimal io_uring submission/completion queue pair, driven with the raw
+ * system calls so that liburing is not required.
+ */
+typedef struct UringQueue UringQueue;
+struct UringQueue
+{
+  int ringfd;
+  void *sqring;
+  void *cqring;
+  size_t sqringsize;
+  size_t cqringsize;
+  struct io_uring_sqe *sqes;
+  size_t sqessize;
+  unsigned *sqtail;
+  unsigned *sqmask;
+  unsigned *sqarray;
+  unsigned *cqhead;
+  unsigned *cqtail;
+  unsigned *cqmask;
+  struct io_uring_cqe *cqes;
+
+  UringQueue() : ringfd(-1), sqring(MAP_FAILED), cqring(MAP_FAILED),
+                 sqes((struct io_uring_sqe *)MAP_FAILED) {}
+
+  ~UringQueue()
+  {
+    if(sqes != MAP_FAILED)
+      munmap(sqes, sqessize);
+    if(cqring != MAP_FAILED && cqring != sqring)
+      munmap(cqring, cqringsize);
+    if(sqring != MAP_FAILED)
+      munmap(sqring, sqringsize);
+    if(ringfd >= 0)
+      close(ringfd);
+  }
+
+  // Returns false if io_uring is not available on this system
+  bool init(unsigned entries)
+  {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ringfd = syscall(__NR_io_uring_setup, entries, &params);
+    if(ringfd < 0)
+      return false;
+
+    sqringsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqringsize = params.cq_off.cqes +
+                 params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if(single)
+      sqringsize = cqringsize = std::max(sqringsize, cqringsize);
+
+    sqring = mmap(NULL, sqringsize, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQ_RING);
+    if(sqring == MAP_FAILED)
+      return false;
+    cqring = single ? sqring :
+             mmap(NULL, cqringsize, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_CQ_RING);
+    if(cqring == MAP_FAILED)
+      return false;
+    sqessize = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe *)mmap(NULL, sqessize,
+                                       PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_POPULATE, ringfd,
+                                       IORING_OFF_SQES);
+    if(sqes == MAP_FAILED)
+      return false;
+
+    char *sq = (char *)sqring;
+    char *cq = (char *)cqring;
+    sqtail = (unsigned *)(sq + params.sq_off.tail);
+    sqmask = (unsigned *)(sq + params.sq_off.ring_mask);
+    sqarray = (unsigned *)(sq + params.sq_off.array);
+    cqhead = (unsigned *)(cq + params.cq_off.head);
+    cqtail = (unsigned *)(cq + params.cq_off.tail);
+    cqmask = (unsigned *)(cq + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return true;
+  }
+
+  void submit_read(int fd, char *buffer, unsigned len, off_t offset,
+                   uint64_t tag)
+  {
+    unsigned tail = *sqtail;
+    unsigned index = tail & *sqmask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = tag;
+    sqarray[index] = index;
+    __atomic_store_n(sqtail, tail + 1, __ATOMIC_RELEASE);
+    while(syscall(__NR_io_uring_enter, ringfd, 1, 0, 0, NULL, 0) < 0 &&
+          errno == EINTR);
+  }
+
+  // Block until a read completes; returns its tag and result
+  void wait(uint64_t *tag, int *result)
+  {
+    while(true)
+    {
+      unsigned head = *cqhead;
+      if(head != __atomic_load_n(cqtail, __ATOMIC_ACQUIRE))
+      {
+        struct io_uring_cqe *cqe = &cqes[head & *cqmask];
+        *tag = cqe->user_data;
+        *result = cqe->res;
+        __atomic_store_n(cqhead, head + 1, __ATOMIC_RELEASE);
+        return;
+      }
+      syscall(__NR_io_uring_enter, ringfd, 0, 1, IORING_ENTER_GETEVENTS,
+              NULL, 0);
+    }
+  }
+};
+#endif
+
+
+/**
+ * @type BlockReader
+ *
+ * Reads bytes [begin, end) of a file as a sequence of `blocksize` blocks,
+ * returned in file order by next(). Up to `depth` blocks are read ahead of
+ * the consumer: with io_uring when the system supports it, and otherwise with
+ * one helper thread per block buffer issuing pread calls. A block returned by
+ * next() stays valid until the following call. With `dropcache`, each block's
+ * pages are dropped from the page cache once the consumer is done with them.
+ * If a read fails, next() returns false from then on and `error` holds its
+ * errno.
+ */
+typedef struct BlockReader BlockReader;
+struct BlockReader
+{
+  struct Buffer
+  {
+    char *data;
+    size_t len;
+    bool full;
+  };
+
+  int fd;
+  off_t begin;
+  off_t end;
+  BlockReaderOptions options;
+  size_t numblocks;
+  size_t current;  // index of the block last returned by next()
+  std::vector<Buffer> buffers;
+  std::unique_ptr<char, decltype(&free)> memory;
+
+  // pread engine
+  std::mutex lock;
+  std::condition_variable changed;
+  std::vector<std::thread> threads;
+  bool stopping;
+  int error;  // errno of the first failed read, or 0
+
+#ifdef SMR_HAVE_IO_URING
+  UringQueue uring;
+  size_t inflight;
+#endif
+  bool useuring;
+
+  BlockReader(int fd, off_t begin, off_t end, const BlockReaderOptions& opts)
+    : fd(fd), begin(begin), end(end), options(opts), current((size_t)-1),
+      memory(NULL, free), stopping(false), error(0), useuring(false)
+  {
+    if(options.depth < 1)
+      options.depth = 1;
+    numblocks = end > begin ? (end - begin + options.blocksize - 1) /
+                              options.blocksize : 0;
+    buffers.resize(options.depth);
+    void *mem;
+    if(posix_memalign(&mem, 4096, options.depth * options.blocksize) != 0)
+    {
+      error = ENOMEM;
+      numblocks = 0;
+      return;
+    }
+    memory.reset((char *)mem);
+    for(unsigned i = 0; i < options.depth; i++)
+    {
+      buffers[i].data = memory.get() + i * options.blocksize;
+      buffers[i].len = 0;
+      buffers[i].full = false;
+    }
+    posix_fadvise(fd, begin, end - begin, POSIX_FADV_SEQUENTIAL);
+
+#ifdef SMR_HAVE_IO_URING
+    inflight = 0;
+    if(options.engine != SMR_IO_PREAD && uring.init(options.depth))
+    {
+      useuring = true;
+      for(size_t i = 0; i < options.depth && i < numblocks; i++)
+        submit(i);
+      return;
+    }
+#endif
+    if(options.engine == SMR_IO_URING)
+      fprintf(stderr, "warning: io_uring unavailable, using pread\n");
+    for(unsigned i = 0; i < options.depth && i < numblocks; i++)
+      threads.emplace_back(&BlockReader::preader, this, i);
+  }
+
+  ~BlockReader()
+  {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+    }
+    changed.notify_all();
+    for(auto& thread : threads)
+      thread.join();
+#ifdef SMR_HAVE_IO_URING
+    while(useuring && inflight > 0)
+    {
+      uint64_t tag;
+      int result;
+      uring.wait(&tag, &result);
+      inflight--;
+    }
+#endif
+  }
+
+  off_t block_offset(size_t block) const
+  {
+    return begin + block * options.blocksize;
+  }
+
+  size_t block_length(size_t block) const
+  {
+    off_t offset = block_offset(block);
+    return std::min<off_t>(options.blocksize, end - offset);
+  }
+
+  // Helper thread for the pread engine: reads blocks i, i + depth, ... into
+  // buffer i, waiting for the consumer to release the buffer each time.
+  void preader(unsigned i)
+  {
+    Buffer& buffer = buffers[i];
+    for(size_t block = i; block < numblocks; block += options.depth)
+    {
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, [&]() { return stopping || !buffer.full; });
+        if(stopping)
+          return;
+      }
+      ssize_t len = smr_pread_full(fd, buffer.data, block_length(block),
+                                   block_offset(block));
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        if(len < 0 && error == 0)
+          error = errno;
+        buffer.len = len < 0 ? 0 : len;
+        buffer.full = true;
+      }
+      changed.notify_all();
+    }
+  }
+
+#ifdef SMR_HAVE_IO_URING
+  void submit(size_t block)
+  {
+    Buffer& buffer = buffers[block % options.depth];
+    buffer.len = 0;
+    buffer.full = false;
+    uring.submit_read(fd, buffer.data, block_length(block), block_offset(block),
+                      block);
+    inflight++;
+  }
+
+  // Reap completions until the given block has been read in full; short or
+  // unsupported reads are completed synchronously.
+  void wait_uring(size_t block)
+  {
+    Buffer& buffer = buffers[block % options.depth];
+    while(!buffer.full)
+    {
+      uint64_t tag;
+      int result;
+      uring.wait(&tag, &result);
+      inflight--;
+      Buffer& done = buffers[tag % options.depth];
+      size_t want = block_length(tag);
+      ssize_t len = result;
+      if(result < 0)
+        len = smr_pread_full(fd, done.data, want, block_offset(tag));
+      else if((size_t)result < want)
+      {
+        len = smr_pread_full(fd, done.data + result, want - result,
+                             block_offset(tag) + result);
+        len = len < 0 ? len : result + len;
+      }
+      if(len < 0 && error == 0)
+        error = errno;
+      done.len = len < 0 ? 0 : len;
+      done.full = true;
+    }
+  }
+#endif
+
+  // Release the previous block and return the next one; returns false once
+  // the whole range has been read.
+  bool next(const char **data, size_t *len)
+  {
+    if(current != (size_t)-1)
+      release(current);
+    current++;
+    if(current >= numblocks)
+      return false;
+
+    Buffer& buffer = buffers[current % options.depth];
+    int failed;
+#ifdef SMR_HAVE_IO_URING
+    if(useuring)
+    {
+      wait_uring(current);
+      failed = error;
+    }
+    else
+#endif
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      changed.wait(guard, [&]() { return buffer.full; });
+      failed = error;
+    }
+    if(failed != 0)
+      return false;
+    *data = buffer.data;
+    *len = buffer.len;
+    return true;
+  }
+
+  void release(size_t block)
+  {
+    if(options.dropcache)
+    {
+      posix_fadvise(fd, block_offset(block), block_length(block),
+                    POSIX_FADV_DONTNEED);
+    }
+#ifdef SMR_HAVE_IO_URING
+    if(useuring)
+    {
+      if(block + options.depth < numblocks)
+        submit(block + options.depth);
+      return;
+    }
+#endif
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      buffers[block % options.depth].full = false;
+    }
+    changed.notify_all();
+  }
+};
+
+#endif
@@ -0,0 +1,177 @@
+/*
+
+Copyright (c) 2013, Daniel S. Standage <daniel.standage@gmail.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#ifndef SMR_CHECKPOINT_HPP
+#define SMR_CHECKPOINT_HPP
+
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "counttable.hpp"
+
+#define SMR_CHECKPOINT_MAGIC "SMRCKPT2"
+
+
+/**
+ * @type Checkpoint
+ *
+ * Saved read counts of one input file, or of the byte range [begin, end) of
+ * its body, so that an interrupted run can pick up where it stopped. Each
+ * file holds a fixed header (magic, begin, end, the number of counts, and the
+ * size of the @SQ ID list), the ID list itself, and then one record per
+ * molecule: its ID length and count as 64-bit integers, then the ID. Files are
+ * written under a temporary name, synced and renamed, so a file that exists
+ * is complete; one that does not parse is ignored and its input recounted.
+ *
+ * Names start with a key that identifies the input (its path, size and
+ * modification time) and the options that change its counts: `KEY.tally` for
+ * a finished file, `KEY-BEGIN.chunk` for a finished range.
+ */
+typedef struct Checkpoint Checkpoint;
+struct Checkpoint
+{
+  uint64_t begin;
+  uint64_t end;
+  std::vector<char> headerids;
+  CountTable counts;
+
+  Checkpoint() : begin(0), end(0) {}
+
+  static std::string tally_path(const std::string& dir, uint64_t key)
+  {
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.tally", (unsigned long long)key);
+    return dir + name;
+  }
+
+  static std::string chunk_path(const std::string& dir, uint64_t key,
+                                uint64_t begin)
+  {
+    char name[64];
+    snprintf(name, sizeof(name), "/%016llx-%llx.chunk",
+             (unsigned long long)key, (unsigned long long)begin);
+    return dir + name;
+  }
+
+  // Write `counts` of the range [begin, end) to `path`; returns false, with
+  // errno set, if it cannot be written, which callers report as an error, as
+  // a run that cannot save its progress should not pretend to
+  static bool save(const std::string& path, const CountTable& counts,
+                   uint64_t begin, uint64_t end,
+                   const std::vector<char>& headerids)
+  {
+    std::string temp = path + ".tmp";
+    FILE *out = fopen(temp.c_str(), "wb");
+    if(out == NULL)
+      return false;
+    uint64_t header[4] = { begin, end, counts.size(), headerids.size() };
+    fwrite(SMR_CHECKPOINT_MAGIC, 1, 8, out);
+    fwrite(header, sizeof(header), 1, out);
+    fwrite(headerids.data(), 1, headerids.size(), out);
+    for(auto kvpair : counts)
+    {
+      uint64_t record[2] = { strlen(kvpair.first), kvpair.second };
+      fwrite(record, sizeof(record), 1, out);
+      fwrite(kvpair.first, 1, record[0], out);
+    }
+    if(fflush(out) != 0 || fsync(fileno(out)) != 0 || ferror(out))
+    {
+      int failure = errno;
+      fclose(out);
+      errno = failure;
+      return false;
+    }
+    return fclose(out) == 0 && rename(temp.c_str(), path.c_str()) == 0;
+  }
+
+  // Read the checkpoint at `path`; returns false if there is none, or if it
+  // is not a complete checkpoint. The sizes in the header are checked against
+  // the length of the file before anything is allocated for them, so a
+  // corrupt header is rejected like any other damage.
+  bool load(const std::string& path)
+  {
+    FILE *in = fopen(path.c_str(), "rb");
+    if(in == NULL)
+      return false;
+    struct stat filestat;
+    char magic[8];
+    uint64_t header[4];
+    bool valid = fstat(fileno(in), &filestat) == 0 &&
+                 fread(magic, 1, 8, in) == 8 &&
+                 memcmp(magic, SMR_CHECKPOINT_MAGIC, 8) == 0 &&
+                 fread(header, sizeof(header), 1, in) == 1;
+    if(valid)
+    {
+      // Each count record takes at least its two 64-bit fields
+      uint64_t left = filestat.st_size - 8 - sizeof(header);
+      valid = header[3] <= left &&
+              header[2] <= (left - header[3]) / (2 * sizeof(uint64_t));
+    }
+    if(valid)
+    {
+      begin = header[0];
+      end = header[1];
+      headerids.resize(header[3]);
+      valid = fread(headerids.data(), 1, header[3], in) == header[3];
+      counts.reserve(header[2]);
+    }
+    std::vector<char> molid;
+    for(uint64_t i = 0; valid && i < header[2]; i++)
+    {
+      uint64_t record[2];
+      valid = fread(record, sizeof(record), 1, in) == 1 &&
+              record[0] < (1 << 24);
+      if(!valid)
+        break;
+      molid.resize(record[0]);
+      valid = fread(molid.data(), 1, record[0], in) == record[0];
+      if(valid)
+        counts.increment(molid.data(), record[0],
+                         smr_hash(molid.data(), record[0]), record[1]);
+    }
+    valid = valid && fgetc(in) == EOF;
+    fclose(in);
+    return valid;
+  }
+
+  // Delete the range checkpoints of the input with key `key`
+  static void remove_chunks(const std::string& dir, uint64_t key)
+  {
+    char prefix[32];
+    snprintf(prefix, sizeof(prefix), "%016llx-", (unsigned long long)key);
+    DIR *listing = opendir(dir.c_str());
+    if(listing == NULL)
+      return;
+    struct dirent *entry;
+    while((entry = readdir(listing)) != NULL)
+    {
+      if(strncmp(entry->d_name, prefix, strlen(prefix)) == 0)
+        unlink((dir + "/" + entry->d_name).c_str());
+    }
+    closedir(listing);
+  }
+};
+
+#endif
@@ -0,0 +1,237 @@
+/*
+
+Copyright (c) 2013, Daniel S. Standage <daniel.standage@gmail.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#ifndef SMR_CONCURRENTTABLE_HPP
+#define SMR_CONCURRENTTABLE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "counttable.hpp"
+
+#define SMR_ARENA_BLOCK_SIZE (1 << 20)
+
+
+/**
+ * @type ConcurrentCountTable
+ *
+ * Fixed-capacity open-addressing hash table mapping molecule IDs to read
+ * counts, shared by all of the threads counting one sample. New IDs are
+ * inserted without locks by publishing a pointer to the key with a single
+ * compare-and-swap, and counts are incremented with relaxed atomic adds.
+ *
+ * Each slot word packs a 48-bit key pointer with the top 16 bits of the key's
+ * hash, so most non-matching slots are skipped without dereferencing the key.
+ * Keys are copied into blocks owned by the table, through a per-thread Arena.
+ *
+ * The table never grows. Once it holds `maxkeys` IDs, increments of new IDs
+ * fail and the caller is expected to count them elsewhere (typically in a
+ * thread-local CountTable that is merged at the end).
+ */
+typedef struct ConcurrentCountTable ConcurrentCountTable;
+struct ConcurrentCountTable
+{
+  struct Record
+  {
+    uint64_t hash;
+    uint32_t len;
+    char str[1];
+  };
+
+  struct Slot
+  {
+    std::atomic<uint64_t> word;
+    std::atomic<uint64_t> count;
+  };
+
+  /**
+   * Per-thread allocator for key records; only the block list is shared.
+   */
+  struct Arena
+  {
+    ConcurrentCountTable *table;
+    char *next;
+    size_t left;
+    Record *last;
+
+    Arena(ConcurrentCountTable *t) : table(t), next(NULL), left(0), last(NULL)
+    {}
+
+    Record *make(const char *key, size_t len, uint64_t h)
+    {
+      size_t size = (offsetof(Record, str) + len + 1 + 7) & ~(size_t)7;
+      if(size > left)
+      {
+        size_t blocksize = size > SMR_ARENA_BLOCK_SIZE ? size :
+                           SMR_ARENA_BLOCK_SIZE;
+        next = table->allocate_block(blocksize);
+        left = blocksize;
+      }
+      last = (Record *)next;
+      next += size;
+      left -= size;
+      last->hash = h;
+      last->len = len;
+      memcpy(last->str, key, len);
+      last->str[len] = '\0';
+      return last;
+    }
+
+    // Give back the most recent record, if it was never published
+    void undo(Record *record)
+    {
+      if(record != last)
+        return;
+      size_t size = (char *)next - (char *)record;
+      next = (char *)record;
+      left += size;
+      last = NULL;
+    }
+  };
+
+  std::unique_ptr<Slot[]> slots;
+  size_t capacity;
+  size_t mask;
+  size_t maxkeys;
+  std::atomic<size_t> numkeys;
+  std::vector<std::unique_ptr<char[]>> blocks;
+  std::mutex blocklock;
+
+  // The table is sized for `expected` IDs at a load factor of at most 1/2;
+  // beyond 3/4 load, inserts fail.
+  ConcurrentCountTable(size_t expected) : numkeys(0)
+  {
+    capacity = 1024;
+    while(capacity < expected * 2)
+      capacity <<= 1;
+    mask = capacity - 1;
+    maxkeys = capacity / 4 * 3;
+    slots.reset(new Slot[capacity]);
+    for(size_t i = 0; i < capacity; i++)
+    {
+      slots[i].word.store(0, std::memory_order_relaxed);
+      slots[i].count.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  char *allocate_block(size_t size)
+  {
+    std::lock_guard<std::mutex> guard(blocklock);
+    blocks.emplace_back(new char[size]);
+    return blocks.back().get();
+  }
+
+  size_t size() const { return numkeys.load(std::memory_order_relaxed); }
+
+  static uint64_t pack(const Record *record, uint64_t h)
+  {
+    return (uint64_t)(uintptr_t)record | (h & 0xffff000000000000ULL);
+  }
+
+  static const Record *unpack(uint64_t word)
+  {
+    return (const Record *)(uintptr_t)(word & 0x0000ffffffffffffULL);
+  }
+
+  void prefetch(uint64_t h) const
+  {
+    __builtin_prefetch(&slots[h & mask], 1, 1);
+  }
+
+  // Returns false if the ID is not yet in the table and the table is full
+  bool increment(const char *key, size_t len, uint64_t h, Arena& arena,
+                 uint64_t by = 1)
+  {
+    const uint64_t tag = h & 0xffff000000000000ULL;
+    Record *record = NULL;
+    size_t i = h & mask;
+    for(size_t probes = 0; probes < capacity; probes++, i = (i + 1) & mask)
+    {
+      Slot& slot = slots[i];
+      uint64_t word = slot.word.load(std::memory_order_acquire);
+      if(word == 0)
+      {
+        if(numkeys.load(std::memory_order_relaxed) >= maxkeys)
+          return false;
+        if(record == NULL)
+          record = arena.make(key, len, h);
+        if(slot.word.compare_exchange_strong(word, pack(record, h),
+                                             std::memory_order_acq_rel))
+        {
+          numkeys.fetch_add(1, std::memory_order_relaxed);
+          slot.count.fetch_add(by, std::memory_order_relaxed);
+          return true;
+        }
+        // Another thread claimed the slot first; `word` now holds its key
+      }
+      if((word & 0xffff000000000000ULL) != tag)
+        continue;
+      const Record *other = unpack(word);
+      if(other->hash == h && other->len == len &&
+         memcmp(other->str, key, len) == 0)
+      {
+        if(record != NULL)
+          arena.undo(record);
+        slot.count.fetch_add(by, std::memory_order_relaxed);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Hash and prefetch a batch of at most SMR_MAX_BATCH keys before
+  // incrementing; IDs that do not fit in the table go to `overflow`.
+  void increment_batch(const CountTable::Key *batch, size_t n, Arena& arena,
+                       CountTable& overflow)
+  {
+    uint64_t hashes[SMR_MAX_BATCH];
+    for(size_t i = 0; i < n; i++)
+    {
+      hashes[i] = smr_hash(batch[i].str, batch[i].len);
+      prefetch(hashes[i]);
+    }
+    for(size_t i = 0; i < n; i++)
+    {
+      if(!increment(batch[i].str, batch[i].len, hashes[i], arena))
+        overflow.increment(batch[i].str, batch[i].len, hashes[i]);
+    }
+  }
+
+  // Add every (ID, count) pair to a count table; not safe to call while other
+  // threads are still incrementing.
+  void merge_into(CountTable& table) const
+  {
+    table.reserve(size());
+    for(size_t i = 0; i < capacity; i++)
+    {
+      uint64_t word = slots[i].word.load(std::memory_order_acquire);
+      if(word == 0)
+        continue;
+      const Record *record = unpack(word);
+      table.increment(record->str, record->len, record->hash,
+                      slots[i].count.load(std::memory_order_relaxed));
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,230 @@
+/*
+
+Copyright (c) 2013, Daniel S. Standage <daniel.standage@gmail.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#ifndef SMR_COUNTCOLUMN_HPP
+#define SMR_COUNTCOLUMN_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "counttable.hpp"
+
+
+/**
+ * @type RowDictionary
+ *
+ * Molecule IDs numbered densely, in the order they were first added, so that
+ * the rows of a matrix can be addressed by number and each ID is stored once
+ * however many samples it appears in.
+ */
+typedef struct RowDictionary RowDictionary;
+struct RowDictionary
+{
+  CountTable rows;  // molecule ID -> row number + 1
+  std::vector<char> names;
+  std::vector<size_t> starts;
+
+  size_t size() const { return starts.size(); }
+  const char *operator[](size_t r) const { return &names[starts[r]]; }
+
+  // Make room for `n` more molecules. Call it before adding the keys of a
+  // CountTable in slot order: those keys arrive sorted by their low hash
+  // bits, and a table that doubles partway through piles them into a few
+  // long probe runs.
+  void reserve(size_t n)
+  {
+    rows.reserve(n);
+    starts.reserve(starts.size() + n);
+  }
+
+  // Returns the row of the molecule, adding it if it is new
+  uint32_t row(const char *molid, size_t len)
+  {
+    uint64_t h = smr_hash(molid, len);
+    uint64_t r = rows.find(molid, len, h);
+    if(r == 0)
+    {
+      starts.push_back(names.size());
+      names.insert(names.end(), molid, molid + len);
+      names.push_back('\0');
+      r = starts.size();
+      rows.increment(molid, len, h, r);
+    }
+    return r - 1;
+  }
+
+  // Returns the row of the molecule, or size() if it has none
+  size_t find(const char *molid, size_t len) const
+  {
+    uint64_t r = rows.find(molid, len);
+    return r == 0 ? size() : r - 1;
+  }
+
+  std::vector<const char *> molids() const
+  {
+    std::vector<const char *> molids;
+    for(size_t start : starts)
+      molids.push_back(&names[start]);
+    return molids;
+  }
+};
+
+
+/**
+ * @type CountColumn
+ *
+ * Dense column of read counts, indexed by row, that starts with 16-bit
+ * counts and is promoted to 32-bit or 64-bit counts as soon as a count too
+ * large for its width is stored. Most molecules of a sample have fewer than
+ * 65536 reads, so most columns stay at 2 bytes per row, while a deep sample
+ * still never overflows. Rows past the end of the column count 0, so a column
+ * does not grow when rows are added to the matrix after it was filled.
+ *
+ * A sample that holds a few molecules of a large matrix would still pay for
+ * every row before its last one, so compact() switches a column that is
+ * mostly zeros to sparse storage: only its nonzero counts, each next to its
+ * row number, in ascending row order.
+ */
+typedef struct CountColumn CountColumn;
+struct CountColumn
+{
+  std::vector<char> data;
+  std::vector<uint32_t> rows;  // if sparse, the row of each count in `data`
+  unsigned width;  // bytes per count: 2, 4 or 8
+  bool sparse;
+
+  CountColumn() : width(2), sparse(false) {}
+
+  // Number of counts stored: every row up to the last one if dense, only the
+  // nonzero ones if sparse
+  size_t size() const { return data.size() / width; }
+  size_t bytes() const { return data.size() + rows.size() * sizeof(uint32_t); }
+
+  // Row and count of stored count `k`
+  size_t row(size_t k) const { return sparse ? rows[k] : k; }
+  uint64_t count(size_t k) const { return load(&data[k * width], width); }
+
+  uint64_t operator[](size_t r) const
+  {
+    if(!sparse)
+      return r < size() ? count(r) : 0;
+    if(rows.empty() || r < rows.front() || r > rows.back())
+      return 0;
+    auto it = std::lower_bound(rows.begin(), rows.end(), r);
+    return it != rows.end() && *it == r ? count(it - rows.begin()) : 0;
+  }
+
+  void resize(size_t n) { data.resize(n * width, 0); }
+
+  void set(size_t r, uint64_t count)
+  {
+    if(width < width_for(count))
+      promote(width_for(count));
+    size_t k = r;
+    if(sparse)
+    {
+      k = std::lower_bound(rows.begin(), rows.end(), r) - rows.begin();
+      if(k == rows.size() || rows[k] != r)
+      {
+        rows.insert(rows.begin() + k, r);
+        data.insert(data.begin() + k * width, width, 0);
+      }
+    }
+    else if(r >= size())
+      resize(r + 1);
+    store(&data[k * width], width, count);
+  }
+
+  // Switch a dense column to sparse storage if that takes fewer bytes
+  void compact()
+  {
+    if(sparse)
+      return;
+    size_t nonzero = 0;
+    for(size_t r = 0; r < size(); r++)
+      nonzero += count(r) > 0;
+    if(nonzero * (sizeof(uint32_t) + width) >= size() * width)
+      return;
+    std::vector<char> counts(nonzero * width);
+    rows.reserve(nonzero);
+    for(size_t r = 0; r < size(); r++)
+    {
+      if(count(r) == 0)
+        continue;
+      memcpy(&counts[rows.size() * width], &data[r * width], width);
+      rows.push_back(r);
+    }
+    data.swap(counts);
+    sparse = true;
+  }
+
+  // Widen every count to `newwidth` bytes
+  void promote(unsigned newwidth)
+  {
+    std::vector<char> wider(size() * newwidth);
+    for(size_t r = 0; r < size(); r++)
+      store(&wider[r * newwidth], newwidth, load(&data[r * width], width));
+    data.swap(wider);
+    width = newwidth;
+  }
+
+  static unsigned width_for(uint64_t count)
+  {
+    if(count <= UINT16_MAX)
+      return 2;
+    return count <= UINT32_MAX ? 4 : 8;
+  }
+
+  static uint64_t load(const char *p, unsigned width)
+  {
+    if(width == 2)
+    {
+      uint16_t count;
+      memcpy(&count, p, sizeof(count));
+      return count;
+    }
+    if(width == 4)
+    {
+      uint32_t count;
+      memcpy(&count, p, sizeof(count));
+      return count;
+    }
+    uint64_t count;
+    memcpy(&count, p, sizeof(count));
+    return count;
+  }
+
+  static void store(char *p, unsigned width, uint64_t count)
+  {
+    if(width == 2)
+    {
+      uint16_t narrow = count;
+      memcpy(p, &narrow, sizeof(narrow));
+    }
+    else if(width == 4)
+    {
+      uint32_t narrow = count;
+      memcpy(p, &narrow, sizeof(narrow));
+    }
+    else
+      memcpy(p, &count, sizeof(count));
+  }
+};
+
+#endif
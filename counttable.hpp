@@ -0,0 +1,242 @@
+/*
+
+Copyright (c) 2013, Daniel S. Standage <daniel.standage@gmail.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#ifndef SMR_COUNTTABLE_HPP
+#define SMR_COUNTTABLE_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#define SMR_MAX_BATCH 256
+
+/**
+ * Hash a molecule ID (64-bit FNV-1a). A hash value of 0 is reserved for empty
+ * table slots, so it is remapped to 1.
+ */
+static inline uint64_t smr_hash(const char *key, size_t len)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for(size_t i = 0; i < len; i++)
+  {
+    h ^= (unsigned char)key[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h ? h : 1;
+}
+
+
+/**
+ * @type CountTable
+ *
+ * Open-addressing (linear probing) hash table mapping molecule IDs to read
+ * counts. Each slot stores the full hash of its key, so probing only touches
+ * the key bytes on a likely match. The slot array can be prefetched by hash,
+ * which lets callers hash a batch of keys, issue prefetches for all of their
+ * slots, and only then perform the increments (see increment_batch).
+ */
+struct CountTable
+{
+  struct Key
+  {
+    const char *str;
+    size_t len;
+  };
+
+  struct Slot
+  {
+    uint64_t hash;
+    uint64_t keyoff : 40;
+    uint64_t keylen : 24;
+    uint64_t count;
+  };
+
+  struct const_iterator
+  {
+    const CountTable *table;
+    size_t index;
+
+    const_iterator(const CountTable *t, size_t i) : table(t), index(i)
+    {
+      skip();
+    }
+    void skip()
+    {
+      while(index < table->slots.size() && table->slots[index].hash == 0)
+        index++;
+    }
+    std::pair<const char *, uint64_t> operator*() const
+    {
+      const Slot& slot = table->slots[index];
+      return std::make_pair(&table->keys[slot.keyoff], slot.count);
+    }
+    const_iterator& operator++()
+    {
+      index++;
+      skip();
+      return *this;
+    }
+    bool operator!=(const const_iterator& other) const
+    {
+      return index != other.index;
+    }
+  };
+
+  std::vector<Slot> slots;
+  std::vector<char> keys;
+  size_t mask;
+  size_t numkeys;
+
+  CountTable(size_t capacity = 1024) : numkeys(0)
+  {
+    size_t n = 16;
+    while(n < capacity)
+      n <<= 1;
+    slots.assign(n, Slot());
+    mask = n - 1;
+  }
+
+  size_t size() const { return numkeys; }
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, slots.size()); }
+
+  void prefetch(uint64_t h) const
+  {
+    __builtin_prefetch(&slots[h & mask], 1, 1);
+  }
+
+  // Ensure that n more keys can be inserted without triggering a rehash, so
+  // that slot addresses prefetched by a caller remain valid.
+  void reserve(size_t n)
+  {
+    size_t need = numkeys + n;
+    if(need * 4 < slots.size() * 3)
+      return;
+    size_t capacity = slots.size();
+    while(need * 4 >= capacity * 3)
+      capacity <<= 1;
+    rehash(capacity);
+  }
+
+  void increment(const char *key, size_t len, uint64_t h, uint64_t by = 1)
+  {
+    size_t i = h & mask;
+    while(true)
+    {
+      Slot& slot = slots[i];
+      if(slot.hash == 0)
+      {
+        if((numkeys + 1) * 4 >= slots.size() * 3)
+        {
+          rehash(slots.size() << 1);
+          increment(key, len, h, by);
+          return;
+        }
+        slot.hash = h;
+        slot.keyoff = keys.size();
+        slot.keylen = len;
+        slot.count = by;
+        keys.insert(keys.end(), key, key + len);
+        keys.push_back('\0');
+        numkeys++;
+        return;
+      }
+      if(slot.hash == h && slot.keylen == len &&
+         memcmp(&keys[slot.keyoff], key, len) == 0)
+      {
+        slot.count += by;
+        return;
+      }
+      i = (i + 1) & mask;
+    }
+  }
+
+  void increment(const char *key, size_t len)
+  {
+    increment(key, len, smr_hash(key, len));
+  }
+
+  // Software-pipelined increments: hash every key in the batch and prefetch
+  // its home slot before touching any of them, so that the cache misses for
+  // the whole batch overlap instead of being serviced one at a time. The batch
+  // may hold at most SMR_MAX_BATCH keys.
+  void increment_batch(const Key *batch, size_t n)
+  {
+    uint64_t hashes[SMR_MAX_BATCH];
+    reserve(n);
+    for(size_t i = 0; i < n; i++)
+    {
+      hashes[i] = smr_hash(batch[i].str, batch[i].len);
+      prefetch(hashes[i]);
+    }
+    for(size_t i = 0; i < n; i++)
+      increment(batch[i].str, batch[i].len, hashes[i]);
+  }
+
+  // Add the counts of another table to this one
+  void merge(const CountTable& other)
+  {
+    reserve(other.size());
+    for(auto& slot : other.slots)
+    {
+      if(slot.hash != 0)
+        increment(&other.keys[slot.keyoff], slot.keylen, slot.hash, slot.count);
+    }
+  }
+
+  uint64_t find(const char *key, size_t len) const
+  {
+    return find(key, len, smr_hash(key, len));
+  }
+
+  uint64_t find(const char *key, size_t len, uint64_t h) const
+  {
+    size_t i = h & mask;
+    while(slots[i].hash != 0)
+    {
+      const Slot& slot = slots[i];
+      if(slot.hash == h && slot.keylen == len &&
+         memcmp(&keys[slot.keyoff], key, len) == 0)
+        return slot.count;
+      i = (i + 1) & mask;
+    }
+    return 0;
+  }
+
+  uint64_t find(const char *key) const { return find(key, strlen(key)); }
+
+  void rehash(size_t capacity)
+  {
+    std::vector<Slot> old;
+    old.swap(slots);
+    slots.assign(capacity, Slot());
+    mask = capacity - 1;
+    for(auto& slot : old)
+    {
+      if(slot.hash == 0)
+        continue;
+      size_t i = slot.hash & mask;
+      while(slots[i].hash != 0)
+        i = (i + 1) & mask;
+      slots[i] = slot;
+    }
+  }
+};
+
+#endif
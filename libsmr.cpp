@@ -0,0 +1,2628 @@
+/*
+
+Copyright (c) 2013, Daniel S. Standage <daniel.standage@gmail.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+
+libsmr: SAM mapped reads, as a library
+
+The SAM file format encodes the alignment (mapping) of short sequence reads to
+longer molecular sequences. This library reads each entry of SAM files, or of
+SAM text pushed from memory, to compute a tally of the number of short reads
+mapped to each molecule. See smr.h for the API.
+
+*/
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cctype>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include "smr.h"
+#include "allowlist.hpp"
+#include "bam.hpp"
+#include "bgzf.hpp"
+#include "blockreader.hpp"
+#include "checkpoint.hpp"
+#include "countcolumn.hpp"
+#include "concurrenttable.hpp"
+#include "counttable.hpp"
+#include "mphf.hpp"
+#include "refindex.hpp"
+#include "samline.hpp"
+#include "sketch.hpp"
+#include "workstealing.hpp"
+
+
+/**
+ * Decide whether the read on SAM line [line, eol) survives subsampling. Reads
+ * are kept when the hash of their QNAME falls below `threshold`, so both mates
+ * of a pair are kept or dropped together, and every run keeps the same reads.
+ */
+static inline bool smr_keep_read(const char *line, const char *eol,
+                                 uint64_t threshold)
+{
+  const char *qnameend = (const char *)memchr(line, '\t', eol - line);
+  size_t len = (qnameend == NULL ? eol : qnameend) - line;
+  return smr_mix(smr_hash(line, len)) < threshold;
+}
+
+static inline uint64_t smr_subsample_threshold(double fraction)
+{
+  return fraction >= 1.0 ? UINT64_MAX : (uint64_t)ldexp(fraction, 64);
+}
+
+// Counts are scaled up by 1/subsample, rounded to the nearest integer
+static inline uint64_t smr_scale(double count, double subsample)
+{
+  if(subsample >= 1.0)
+    return (uint64_t)count;
+  return (uint64_t)llround(count / subsample);
+}
+
+
+/**
+ * @type TallyWorker
+ *
+ * The counting state of one task: a byte range of one sample, or the records
+ * pushed into one sample from memory. Ranges are read in blocks by a
+ * BlockReader (see blockreader.hpp), and lines are parsed in place. Molecule
+ * IDs are collected in batches of up to `batchsize` records, and each batch is
+ * hashed and prefetched before any of its counts are incremented. Reads are
+ * counted in the sample's header index if there is one, otherwise in the
+ * sample's shared table if there is one, and otherwise in the worker's own
+ * `local` table. Anything the shared structures cannot hold also goes to
+ * `local`.
+ *
+ * In approximate mode, reads are instead counted in the sample's count-min
+ * sketch, and the worker tracks its own list of heavy hitters, which the
+ * caller merges into the sample's list. When subsampling, only reads whose
+ * QNAME hash is below `keep` are counted. With an allowlist, only reads mapped
+ * to a listed molecule are counted. If `progress` is set, the bytes and lines
+ * of each block read are added to it (see SmrProgress).
+ */
+#define SMR_STAGING_SIZE 65536
+
+// Fewest bytes of input that hold one record: the shortest SAM line, eleven
+// one-character fields, or about what a BAM record compresses to
+#define SMR_MIN_RECORD_BYTES 22
+
+// Bytes read and lines parsed so far from one file, added to by every worker
+// counting part of it with relaxed atomic adds, and read by the progress
+// monitor while counting goes on
+typedef struct
+{
+  uint64_t bytes;
+  uint64_t records;
+} SmrProgress;
+
+typedef struct TallyWorker TallyWorker;
+struct TallyWorker
+{
+  CountTable local;
+  HeaderIndex *index;
+  ConcurrentCountTable *shared;
+  ConcurrentCountTable::Arena arena;
+  CountMinSketch *sketch;
+  HeavyHitters heavy;
+  bool atomic;
+  uint64_t keep;
+  const IdAllowlist *ids;
+  std::vector<CountTable::Key> batch;
+  unsigned n;
+  std::vector<char> staged;
+  SmrProgress *progress;
+  const ReferenceIndex *reference;
+  ReferenceIndex::Counts *refcounts;  // from reference->acquire()
+
+  TallyWorker(HeaderIndex *index, ConcurrentCountTable *shared,
+              CountMinSketch *sketch, size_t toplist, bool atomic,
+              uint64_t keep, const IdAllowlist *ids, unsigned batchsize)
+    : index(index), shared(shared), arena(shared), sketch(sketch),
+      heavy(toplist), atomic(atomic), keep(keep), ids(ids), batch(batchsize),
+      n(0), progress(NULL), reference(NULL), refcounts(NULL) {}
+
+  ~TallyWorker()
+  {
+    if(refcounts != NULL)
+    {
+      reference->fold(*refcounts, local);
+      reference->release(refcounts);
+    }
+  }
+
+  TallyWorker(const TallyWorker&) = delete;
+  TallyWorker& operator=(const TallyWorker&) = delete;
+
+  // Count the reads mapped to molecules of a reference index in a dense array
+  // borrowed from the index, rather than in the worker's table
+  void use_reference(const ReferenceIndex *index)
+  {
+    reference = index;
+    if(index != NULL)
+      refcounts = index->acquire();
+  }
+
+  // Move the counts of the dense array into the worker's table
+  void fold_reference()
+  {
+    if(refcounts != NULL)
+      reference->fold(*refcounts, local);
+  }
+
+  void count_batch(const CountTable::Key *batch, size_t n)
+  {
+    if(sketch != NULL)
+    {
+      uint64_t hashes[SMR_MAX_BATCH];
+      uint32_t estimates[SMR_MAX_BATCH];
+      sketch->increment_batch(batch, n, atomic, hashes, estimates);
+      for(size_t i = 0; i < n; i++)
+        heavy.offer(batch[i].str, batch[i].len, hashes[i], estimates[i]);
+    }
+    else if(reference != NULL)
+      reference->increment_batch(batch, n, *refcounts, local);
+    else if(index != NULL)
+      index->increment_batch(batch, n, local, atomic);
+    else if(shared != NULL)
+      shared->increment_batch(batch, n, arena, local);
+    else
+      local.increment_batch(batch, n);
+  }
+
+  // Queue the line [line, eol) for counting. The line must stay in memory
+  // until the next call to flush().
+  void add_line(const char *line, const char *eol)
+  {
+    const char *molid;
+    size_t len;
+    if(smr_parse_alignment(line, eol, &molid, &len))
+      add_read(line, eol, molid, len);
+  }
+
+  // Queue a read named by the first field of [qname, end), mapped to the
+  // molecule [molid, molid + len), for counting. The molecule ID must stay in
+  // memory until the next call to flush().
+  void add_read(const char *qname, const char *end, const char *molid,
+                size_t len)
+  {
+    if(ids != NULL && !ids->contains(molid, len))
+      return;
+    if(keep != UINT64_MAX && !smr_keep_read(qname, end, keep))
+      return;
+    batch[n].str = molid;
+    batch[n].len = len;
+    if(++n == batch.size())
+      flush();
+  }
+
+  // Queue the line [line, eol) for counting, copying its molecule ID into the
+  // staging area so that the caller may reuse the line right away. The staging
+  // area is flushed rather than grown, so its keys never move.
+  void stage_line(const char *line, const char *eol)
+  {
+    const char *molid;
+    size_t len;
+    if(!smr_parse_alignment(line, eol, &molid, &len))
+      return;
+    if(ids != NULL && !ids->contains(molid, len))
+      return;
+    if(keep != UINT64_MAX && !smr_keep_read(line, eol, keep))
+      return;
+    if(staged.size() + len > staged.capacity())
+    {
+      flush();
+      staged.reserve(std::max(len, (size_t)SMR_STAGING_SIZE));
+    }
+    size_t offset = staged.size();
+    staged.insert(staged.end(), molid, molid + len);
+    batch[n].str = staged.data() + offset;
+    batch[n].len = len;
+    if(++n == batch.size())
+      flush();
+  }
+
+  void flush()
+  {
+    count_batch(&batch[0], n);
+    n = 0;
+    staged.clear();
+  }
+
+  // Count the alignments whose lines start within bytes [begin, end) of the
+  // file. If `begin` falls inside a line, that line is left to the worker
+  // whose range contains its start; the last line is read past `end` if it
+  // needs to be. A line cut by the end of a block is carried in a
+  // SamSplitLine, so lines of any length are counted in bounded memory.
+  // Returns false, with errno set, if the file cannot be opened or read.
+  bool count(const char *infilename, off_t begin, off_t end, off_t bodyoffset,
+             const BlockReaderOptions& io)
+  {
+    int fd = open(infilename, O_RDONLY);
+    if(fd < 0)
+      return false;
+
+    bool skipping = begin > bodyoffset;
+    SamSplitLine carry;
+    int failed;
+    {
+      BlockReader reader(fd, skipping ? begin - 1 : begin, end, io);
+      const char *data;
+      size_t len;
+      while(reader.next(&data, &len))
+      {
+        const char *p = data;
+        const char *stop = data + len;
+        const char *eol;
+        uint64_t lines = 0;
+        if(progress != NULL)
+          __atomic_fetch_add(&progress->bytes, len, __ATOMIC_RELAXED);
+        if(skipping)
+        {
+          eol = (const char *)memchr(p, '\n', stop - p);
+          if(eol == NULL)
+            continue;
+          p = eol + 1;
+          skipping = false;
+        }
+        if(!carry.empty())
+        {
+          eol = (const char *)memchr(p, '\n', stop - p);
+          carry.append(p, eol == NULL ? stop : eol);
+          if(eol == NULL)
+            continue;
+          add_line(carry.begin(), carry.end());
+          carry.close();
+          p = eol + 1;
+          lines++;
+        }
+        while(p < stop && (eol = (const char *)memchr(p, '\n', stop - p)))
+        {
+          add_line(p, eol);
+          p = eol + 1;
+          lines++;
+        }
+        flush();
+        if(p < stop)
+          carry.start(p, stop);
+        if(progress != NULL)
+          __atomic_fetch_add(&progress->records, lines, __ATOMIC_RELAXED);
+      }
+      failed = reader.error;
+    }
+
+    if(failed == 0 && !carry.empty())
+    {
+      char buffer[65536];
+      off_t offset = end;
+      ssize_t len;
+      while((len = smr_pread_full(fd, buffer, sizeof(buffer), offset)) > 0)
+      {
+        const char *eol = (const char *)memchr(buffer, '\n', len);
+        carry.append(buffer, eol == NULL ? buffer + len : eol);
+        if(eol != NULL)
+          break;
+        offset += len;
+      }
+      if(len < 0)
+        failed = errno;
+      add_line(carry.begin(), carry.end());
+      flush();
+    }
+    close(fd);
+    errno = failed;
+    return failed == 0;
+  }
+
+  // Count the alignments of a BAM file whose records start within virtual
+  // offsets [begin, end); `refnames` maps reference IDs to molecule IDs.
+  // Records are decoded from the BGZF blocks of the range only. Returns false
+  // if the file cannot be opened, or if a block or record in the range is
+  // corrupt or truncated.
+  bool count_bam(const char *infilename, uint64_t begin, uint64_t end,
+                 const std::vector<std::string>& refnames)
+  {
+    int fd = open(infilename, O_RDONLY);
+    if(fd < 0)
+      return false;
+    BgzfReader reader(fd);
+    std::vector<char> record;
+    uint64_t counted = begin >> 16;
+    uint64_t lines = 0;
+    bool valid = reader.seek(begin);
+    while(valid && reader.tell() < end)
+    {
+      uint32_t len;
+      BamRecord alignment;
+      if(!reader.read(&len, 4))
+        break;
+      record.resize(len);
+      valid = reader.read(record.data(), len) &&
+              alignment.parse(record.data(), len);
+      if(!valid)
+        break;
+      if(alignment.refid >= 0 && (size_t)alignment.refid < refnames.size() &&
+         (alignment.flag & 0x4) == 0)
+      {
+        const std::string& molid = refnames[alignment.refid];
+        add_read(alignment.qname, alignment.qname + alignment.qnamelen,
+                 molid.data(), molid.length());
+      }
+      lines++;
+      if(progress != NULL && reader.offset != counted)
+      {
+        __atomic_fetch_add(&progress->bytes, reader.offset - counted,
+                           __ATOMIC_RELAXED);
+        __atomic_fetch_add(&progress->records, lines, __ATOMIC_RELAXED);
+        counted = reader.offset;
+        lines = 0;
+      }
+    }
+    flush();
+    close(fd);
+    if(reader.corrupt || !valid)
+      return false;
+    if(progress != NULL)
+    {
+      if((end >> 16) > counted)
+        __atomic_fetch_add(&progress->bytes, (end >> 16) - counted,
+                           __ATOMIC_RELAXED);
+      __atomic_fetch_add(&progress->records, lines, __ATOMIC_RELAXED);
+    }
+    return true;
+  }
+};
+
+
+/**
+ * @type ReadTally
+ *
+ * This class is an instance of a count table (see counttable.hpp). Each key is
+ * a unique ID corresponding to a molecule, and the value is the number of reads
+ * mapped to that molecule.
+ *
+ * A tally is filled from a file in three steps, each of which may run on a
+ * different thread: read_header() scans the SAM header, TallyWorkers count the
+ * reads in byte ranges of the file body (concurrently, for disjoint ranges),
+ * and finish() folds any shared structures into the table. A tally filled
+ * from memory instead goes through push_line(), which handles the header
+ * itself and counts alignments with a single worker, `stream`.
+ *
+ * A BAM file (see bam.hpp) is counted by spans of BGZF virtual offsets rather
+ * than byte ranges: the whole file after its header, or, with `regions`, only
+ * the spans that its .bai index gives for the molecules of the allowlist, so
+ * that the rest of the file is never read.
+ *
+ * With the `perfecthash` option, the molecule IDs declared in the header are
+ * indexed with a minimal perfect hash (see mphf.hpp) before the first alignment
+ * is read, and reads are counted in a dense array. Reads mapped to molecules
+ * missing from the header fall back to the count table.
+ *
+ * With a reference index (see refindex.hpp), each worker counts reads mapped
+ * to indexed molecules in a dense array of its own, which is folded into its
+ * table when the worker is merged. The index is shared by every file.
+ *
+ * With `sharedtable`, all threads counting the file use one lock-free table
+ * (see concurrenttable.hpp), sized from the number of @SQ lines in the header.
+ * Otherwise each worker counts into a table of its own, which the caller
+ * merges into the tally.
+ *
+ * With `approx`, reads are counted in a count-min sketch (see sketch.hpp)
+ * instead, and only the molecules in the sample's heavy-hitter list are added
+ * to the table, by finish(). The sketch is kept so that any molecule can still
+ * be estimated when the matrix is exported.
+ */
+typedef struct ReadTally ReadTally;
+struct ReadTally : public CountTable
+{
+  std::string name;
+  off_t bodyoffset;
+  off_t filesize;
+  size_t numsq;
+  std::vector<char> sqids;
+  std::vector<char> headerids;
+  CountTable lengths;  // @SQ ID -> LN, for RPKM
+  std::unique_ptr<HeaderIndex> index;
+  std::unique_ptr<ConcurrentCountTable> shared;
+  std::unique_ptr<CountMinSketch> sketch;
+  std::unique_ptr<HeavyHitters> heavy;
+  std::unique_ptr<TallyWorker> stream;
+  SamSplitLine carry;
+  bool ready;
+  bool done;
+  size_t expected;
+  const IdAllowlist *ids;
+  const ReferenceIndex *reference;
+  bool regions;      // seek to the allowlisted molecules of an indexed BAM
+  bool bam;
+  std::vector<std::string> refnames;    // BAM reference ID -> molecule ID
+  std::vector<BamIndex::Span> spans;    // BAM virtual offsets to count
+  uint64_t key;      // identifies the file's checkpoints
+  bool restored;     // counts were loaded from a checkpoint
+  SmrProgress progress;
+  uint64_t merged;   // bytes of the body whose counts are in the table
+  uint64_t total;    // reads counted, once finished
+  std::string error;
+
+  ReadTally(const char *name, size_t expected = 0,
+            const IdAllowlist *ids = NULL)
+    : name(name), bodyoffset(0), filesize(0), numsq(0), lengths(16),
+      ready(false), done(false), expected(expected), ids(ids), reference(NULL),
+      regions(false), bam(false), key(0), restored(false), progress(),
+      merged(0), total(0) {}
+
+  // Scan the header, recording where the first alignment starts and counting
+  // the @SQ lines; then set up the header index and shared table, if needed.
+  bool read_header(const SmrConfig& config)
+  {
+    FILE *instream = fopen(name.c_str(), "r");
+    if(instream == NULL)
+    {
+      error = "error opening file " + name;
+      return false;
+    }
+
+    struct stat filestat;
+    fstat(fileno(instream), &filestat);
+    filesize = filestat.st_size;
+
+    int first = fgetc(instream);
+    if(first == 0x1f)
+    {
+      fclose(instream);
+      if(!read_bam_header(config))
+        return false;
+    }
+    else
+    {
+      ungetc(first, instream);
+      char *line = NULL;
+      size_t capacity = 0;
+      ssize_t len;
+      while((len = getline(&line, &capacity, instream)) > 0 &&
+            line[0] == '@')
+      {
+        header_line(line, line + len, config);
+        bodyoffset += len;
+      }
+      free(line);
+      fclose(instream);
+    }
+
+    setup(config, config.numthreads > 1);
+    return true;
+  }
+
+  // Read the reference list of a BAM file as if it were @SQ lines, and pick
+  // the spans to count. Spans of the .bai index that touch are merged, and
+  // `filesize` becomes the compressed size of the spans, so that progress is
+  // reported against what is actually read. Without an index, the whole file
+  // is counted, and reads outside the regions are dropped by the allowlist.
+  bool read_bam_header(const SmrConfig& config)
+  {
+    int fd = open(name.c_str(), O_RDONLY);
+    BamHeader header;
+    bool valid = false;
+    uint64_t first = 0;
+    if(fd >= 0)
+    {
+      BgzfReader reader(fd);
+      valid = header.read(reader);
+      first = reader.tell();
+      close(fd);
+    }
+    if(!valid)
+    {
+      error = "error reading BAM header of " + name;
+      return false;
+    }
+    for(size_t r = 0; r < header.names.size(); r++)
+    {
+      std::string sq = "@SQ\tSN:" + header.names[r] + "\tLN:" +
+                       std::to_string(header.lengths[r]);
+      header_line(sq.data(), sq.data() + sq.length(), config);
+    }
+    refnames.swap(header.names);
+    bam = true;
+
+    BamIndex bai;
+    bool indexed = false;
+    if(regions)
+    {
+      indexed = bai.load(name + ".bai");
+      if(!indexed && name.length() > 4 &&
+         name.compare(name.length() - 4, 4, ".bam") == 0)
+      {
+        bai = BamIndex();
+        indexed = bai.load(name.substr(0, name.length() - 4) + ".bai");
+      }
+    }
+    spans.clear();
+    if(!indexed)
+      spans.push_back(BamIndex::Span(first, (uint64_t)filesize << 16));
+    else
+    {
+      if(bai.spans.size() != refnames.size())
+      {
+        error = "error: BAM index of " + name + " does not match its header";
+        return false;
+      }
+      std::vector<BamIndex::Span> wanted;
+      for(size_t r = 0; r < refnames.size(); r++)
+      {
+        if(bai.spans[r].first < bai.spans[r].second &&
+           ids->contains(refnames[r].data(), refnames[r].length()))
+          wanted.push_back(bai.spans[r]);
+      }
+      std::sort(wanted.begin(), wanted.end());
+      for(auto& span : wanted)
+      {
+        if(!spans.empty() && span.first <= spans.back().second)
+          spans.back().second = std::max(spans.back().second, span.second);
+        else
+          spans.push_back(span);
+      }
+    }
+    filesize = 0;
+    for(auto& span : spans)
+      filesize += (span.second >> 16) - (span.first >> 16);
+    return true;
+  }
+
+  // Count the header line [line, eol) if it is an @SQ line, and keep its ID
+  // for the header index and for sorting rows in header order, and its
+  // length for RPKM.
+  void header_line(const char *line, const char *eol, const SmrConfig& config)
+  {
+    if(eol - line < 4 || strncmp(line, "@SQ\t", 4) != 0)
+      return;
+    numsq++;
+    if(config.perfecthash && !config.approx)
+      parse_sq_line(line, eol, sqids);
+    if(config.sort == SMR_SORT_HEADER)
+      parse_sq_line(line, eol, headerids);
+    if(config.normalize == SMR_NORMALIZE_RPKM)
+    {
+      size_t snlen, lnlen;
+      const char *sn = sq_field(line, eol, "\tSN:", &snlen);
+      const char *ln = sq_field(line, eol, "\tLN:", &lnlen);
+      if(sn != NULL && ln != NULL && lengths.find(sn, snlen) == 0)
+        lengths.increment(sn, snlen, smr_hash(sn, snlen),
+                          strtoull(ln, NULL, 10));
+    }
+  }
+
+  // Find the field starting with `tag` (a tab, two letters and a colon) in
+  // the @SQ header line [line, eol); returns its value and sets `len`, or
+  // returns NULL if the line has no such field
+  static const char *sq_field(const char *line, const char *eol,
+                              const char *tag, size_t *len)
+  {
+    for(const char *tab = line; tab != NULL && eol - tab > 4;
+        tab = (const char *)memchr(tab + 1, '\t', eol - tab - 1))
+    {
+      if(strncmp(tab, tag, 4) != 0)
+        continue;
+      const char *value = tab + 4;
+      const char *end = value;
+      while(end < eol && *end != '\t' && *end != '\n')
+        end++;
+      *len = end - value;
+      return value;
+    }
+    return NULL;
+  }
+
+  // Append the SN: field of the @SQ header line [line, eol) to `sqids`
+  static void parse_sq_line(const char *line, const char *eol,
+                            std::vector<char>& sqids)
+  {
+    size_t len;
+    const char *sn = sq_field(line, eol, "\tSN:", &len);
+    if(sn == NULL)
+      return;
+    sqids.insert(sqids.end(), sn, sn + len);
+    sqids.push_back('\0');
+  }
+
+  // Build the structures reads are counted in, once the header has been seen
+  void setup(const SmrConfig& config, bool threaded)
+  {
+    if(config.approx)
+    {
+      sketch.reset(new CountMinSketch(config.sketchwidth));
+      heavy.reset(new HeavyHitters(config.toplist));
+    }
+    else
+    {
+      if(!sqids.empty())
+        index.reset(new HeaderIndex(sqids));
+      if(threaded && config.sharedtable)
+        shared.reset(new ConcurrentCountTable(numsq));
+    }
+    std::vector<char>().swap(sqids);
+    ready = true;
+  }
+
+  // Count one line pushed from memory. Lines are staged (see TallyWorker)
+  // unless `inplace` is set, in which case the line must stay in memory until
+  // the next flush of `stream`.
+  void push_line(const char *line, const char *eol, const SmrConfig& config,
+                 bool inplace)
+  {
+    if(!stream)
+    {
+      if(line < eol && line[0] == '@')
+      {
+        header_line(line, eol, config);
+        return;
+      }
+      setup(config, false);
+      stream.reset(new TallyWorker(index.get(), NULL, sketch.get(),
+                                   config.toplist, false,
+                                   smr_subsample_threshold(config.subsample),
+                                   ids, config.batchsize));
+      stream->use_reference(reference);
+      presize(*stream);
+    }
+    if(inplace)
+      stream->add_line(line, eol);
+    else
+      stream->stage_line(line, eol);
+  }
+
+  // Count the complete lines of [data, data + len), keeping what counting
+  // needs of a partial last line in `carry` for the next buffer.
+  void push_buffer(const char *data, size_t len, const SmrConfig& config)
+  {
+    const char *p = data;
+    const char *stop = data + len;
+    const char *eol;
+    if(!carry.empty())
+    {
+      eol = (const char *)memchr(p, '\n', stop - p);
+      carry.append(p, eol == NULL ? stop : eol);
+      if(eol == NULL)
+        return;
+      push_line(carry.begin(), carry.end(), config, true);
+      carry.close();
+      p = eol + 1;
+    }
+    while(p < stop && (eol = (const char *)memchr(p, '\n', stop - p)))
+    {
+      push_line(p, eol, config, true);
+      p = eol + 1;
+    }
+    if(stream)
+      stream->flush();
+    if(p < stop)
+      carry.start(p, stop);
+  }
+
+  // A worker counting in its own table sizes it for the number of molecules
+  // expected, so that the table never grows while counting; but never for
+  // more records than its `bytes` of input can hold, so that a small task
+  // after a large job does not allocate, clear and merge a large table.
+  void presize(TallyWorker& worker, uint64_t bytes = UINT64_MAX) const
+  {
+    if(expected > 0 && !index && !shared && !sketch)
+      worker.local.reserve(std::min<uint64_t>(expected,
+                                              bytes / SMR_MIN_RECORD_BYTES));
+  }
+
+  // Add a worker's counts, or its heavy hitters, to the tally; not safe to
+  // call from several threads at once. The first table merged is taken over
+  // rather than copied.
+  void merge_worker(TallyWorker& worker)
+  {
+    worker.fold_reference();
+    if(!heavy && this->size() == 0)
+    {
+      std::swap(static_cast<CountTable&>(*this), worker.local);
+      return;
+    }
+    if(!heavy)
+    {
+      this->merge(worker.local);
+      return;
+    }
+    for(auto& kvpair : worker.heavy.entries)
+    {
+      const std::string& molid = kvpair.second.molid;
+      heavy->offer(molid.c_str(), molid.length(), kvpair.first,
+                   sketch->estimate(kvpair.first));
+    }
+  }
+
+  uint64_t count(const char *molid, size_t len) const
+  {
+    if(sketch)
+      return sketch->estimate(molid, len);
+    return this->find(molid, len);
+  }
+
+  void finish(const SmrConfig& config)
+  {
+    if(done)
+      return;
+    __atomic_store_n(&done, true, __ATOMIC_RELAXED);
+    if(!carry.empty())
+    {
+      push_line(carry.begin(), carry.end(), config, true);
+      if(stream)
+        stream->flush();
+      carry = SamSplitLine();
+    }
+    if(stream)
+    {
+      stream->flush();
+      merge_worker(*stream);
+      stream.reset();
+    }
+    else if(!ready)
+      setup(config, false);
+
+    if(heavy)
+    {
+      for(auto& kvpair : heavy->entries)
+      {
+        const std::string& molid = kvpair.second.molid;
+        this->increment(molid.c_str(), molid.length(), kvpair.first,
+                        sketch->estimate(kvpair.first));
+      }
+    }
+    if(shared)
+      shared->merge_into(*this);
+    for(size_t i = 0; index && i < index->size(); i++)
+    {
+      const HeaderIndex::Entry& entry = index->entries[i];
+      if(entry.count > 0)
+      {
+        const char *molid = index->name(i);
+        this->increment(molid, entry.length, smr_hash(molid, entry.length),
+                        entry.count);
+      }
+    }
+    index.reset();
+    shared.reset();
+    heavy.reset();
+    for(auto kvpair : *this)
+      total += kvpair.second;
+    if(sketch)
+      total = sketch->total;
+  }
+
+  // Free the counts once they have been written out
+  void release()
+  {
+    static_cast<CountTable&>(*this) = CountTable(16);
+    sketch.reset();
+  }
+};
+
+
+/**
+ * @type TallyTask
+ *
+ * A byte range of one input file, counted as a unit by the scheduler. Files
+ * larger than the chunk size are split into several tasks. For a BAM file,
+ * the range is one of its spans of virtual offsets, which are not split.
+ */
+typedef struct TallyTask TallyTask;
+struct TallyTask
+{
+  size_t sample;
+  off_t begin;
+  off_t end;
+};
+
+
+/**
+ * @type SmrEngine
+ *
+ * Warm state for a long-lived process that runs many counters: a worker pool
+ * that is started once, and the set of every molecule ID counted so far.
+ * Counters created from the engine run on its pool and presize their tables
+ * for the size of the set, capped by the bytes each task reads, so repeated
+ * jobs against the same reference neither start threads nor grow tables.
+ */
+struct SmrEngine
+{
+  WorkStealingPool pool;
+  CountTable dictionary;
+  std::mutex lock;
+
+  SmrEngine(unsigned numthreads) : pool(numthreads) {}
+
+  size_t size()
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    return dictionary.size();
+  }
+
+  void learn(const CountTable& table)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    dictionary.reserve(table.size());
+    for(auto kvpair : table)
+    {
+      size_t len = strlen(kvpair.first);
+      if(dictionary.find(kvpair.first, len) == 0)
+        dictionary.increment(kvpair.first, len);
+    }
+  }
+};
+
+
+/**
+ * Sort `v` on the threads of `pool`: one range per thread is sorted on its
+ * own, then sorted ranges are merged pairwise, each round of merges also in
+ * parallel.
+ */
+template<typename T, typename Less>
+static void smr_parallel_sort(std::vector<T>& v, Less less,
+                              WorkStealingPool& pool)
+{
+  size_t parts = pool.numthreads;
+  if(parts < 2 || v.size() < 65536)
+  {
+    std::sort(v.begin(), v.end(), less);
+    return;
+  }
+
+  std::vector<size_t> bounds;
+  std::vector<size_t> ranges;
+  for(size_t i = 0; i <= parts; i++)
+    bounds.push_back(v.size() * i / parts);
+  for(size_t i = 0; i < parts; i++)
+    ranges.push_back(i);
+  pool.run(ranges, [&v, &bounds, &less](size_t i) {
+    std::sort(v.begin() + bounds[i], v.begin() + bounds[i + 1], less);
+  });
+  for(size_t width = 1; width < parts; width *= 2)
+  {
+    std::vector<size_t> merges;
+    for(size_t i = 0; i + width < parts; i += 2 * width)
+      merges.push_back(i);
+    pool.run(merges, [&v, &bounds, &less, width, parts](size_t i) {
+      std::inplace_merge(v.begin() + bounds[i], v.begin() + bounds[i + width],
+                         v.begin() + bounds[std::min(i + 2 * width, parts)],
+                         less);
+    });
+  }
+}
+
+
+// Compare molecule IDs with runs of digits ordered by numeric value, so that
+// chr2 comes before chr10
+static int smr_natural_compare(const char *a, const char *b)
+{
+  while(*a && *b)
+  {
+    if(isdigit((unsigned char)*a) && isdigit((unsigned char)*b))
+    {
+      while(*a == '0')
+        a++;
+      while(*b == '0')
+        b++;
+      size_t alen = 0, blen = 0;
+      while(isdigit((unsigned char)a[alen]))
+        alen++;
+      while(isdigit((unsigned char)b[blen]))
+        blen++;
+      if(alen != blen)
+        return alen < blen ? -1 : 1;
+      int cmp = strncmp(a, b, alen);
+      if(cmp != 0)
+        return cmp;
+      a += alen;
+      b += blen;
+      continue;
+    }
+    if(*a != *b)
+      return (unsigned char)*a < (unsigned char)*b ? -1 : 1;
+    a++;
+    b++;
+  }
+  return *a ? 1 : (*b ? -1 : 0);
+}
+
+
+/**
+ * @type RowOrder
+ *
+ * The order in which rows are printed, chosen by SmrConfig.sort. For header
+ * order, each sample's @SQ IDs are learned when the sample is finished. An ID
+ * is ranked by the first sample (in input order) whose header declares it, and
+ * then by its position in that header, so the order does not depend on which
+ * sample finished first. Molecules missing from every header come last, by
+ * name.
+ */
+typedef struct RowOrder RowOrder;
+struct RowOrder
+{
+  typedef std::pair<uint32_t, uint32_t> HeaderKey;
+
+  int sort;
+  CountTable headerrank;  // molecule ID -> index in headerkeys + 1
+  std::vector<HeaderKey> headerkeys;
+  std::mutex lock;
+
+  RowOrder(int sort) : sort(sort) {}
+
+  void learn_header(size_t sample, const std::vector<char>& ids)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    uint32_t position = 0;
+    for(size_t i = 0; i < ids.size(); i += strlen(&ids[i]) + 1, position++)
+    {
+      const char *molid = &ids[i];
+      size_t len = strlen(molid);
+      HeaderKey key(sample, position);
+      unsigned rank = headerrank.find(molid, len);
+      if(rank == 0)
+      {
+        headerkeys.push_back(key);
+        headerrank.increment(molid, len, smr_hash(molid, len),
+                             headerkeys.size());
+      }
+      else if(key < headerkeys[rank - 1])
+        headerkeys[rank - 1] = key;
+    }
+  }
+
+  // Row numbers in printing order; empty if rows are printed as they are.
+  // `totals` holds the sum of each row's counts, for sorting by count.
+  std::vector<uint32_t> permutation(const std::vector<const char *>& names,
+                                    const std::vector<uint64_t>& totals,
+                                    WorkStealingPool& pool)
+  {
+    std::vector<uint32_t> perm;
+    if(sort == SMR_SORT_NONE)
+      return perm;
+    for(uint32_t i = 0; i < names.size(); i++)
+      perm.push_back(i);
+
+    auto byname = [&names](uint32_t a, uint32_t b) {
+      return strcmp(names[a], names[b]) < 0;
+    };
+    if(sort == SMR_SORT_NAME)
+      smr_parallel_sort(perm, byname, pool);
+    else if(sort == SMR_SORT_NATURAL)
+    {
+      smr_parallel_sort(perm, [&names](uint32_t a, uint32_t b) {
+        return smr_natural_compare(names[a], names[b]) < 0;
+      }, pool);
+    }
+    else if(sort == SMR_SORT_COUNT)
+    {
+      smr_parallel_sort(perm, [&names, &totals, &byname](uint32_t a,
+                                                         uint32_t b) {
+        if(totals[a] != totals[b])
+          return totals[a] > totals[b];
+        return byname(a, b);
+      }, pool);
+    }
+    else
+    {
+      std::vector<HeaderKey> keys;
+      HeaderKey missing(UINT32_MAX, UINT32_MAX);
+      for(const char *molid : names)
+      {
+        unsigned rank = headerrank.find(molid, strlen(molid));
+        keys.push_back(rank == 0 ? missing : headerkeys[rank - 1]);
+      }
+      smr_parallel_sort(perm, [&keys, &byname](uint32_t a, uint32_t b) {
+        if(keys[a] != keys[b])
+          return keys[a] < keys[b];
+        return byname(a, b);
+      }, pool);
+    }
+    return perm;
+  }
+};
+
+
+/**
+ * Multiply a row of counts, one per sample, by each sample's factor and by the
+ * molecule's. Counts below 2^52 are converted to doubles by placing their bits
+ * in the mantissa of 2^52 and subtracting 2^52, which needs only integer and
+ * double operations that every SIMD level has, so the compiler vectorizes the
+ * whole loop even for SSE2.
+ */
+static void smr_normalize_row(const uint64_t *__restrict counts,
+                              const double *__restrict factors,
+                              double rowfactor, double *__restrict values,
+                              size_t n)
+{
+  for(size_t i = 0; i < n; i++)
+  {
+    uint64_t bits = counts[i] | 0x4330000000000000ULL;
+    double count;
+    memcpy(&count, &bits, sizeof(count));
+    values[i] = (count - 4503599627370496.0) * factors[i] * rowfactor;
+  }
+}
+
+
+/**
+ * @type Normalizer
+ *
+ * Prints rows of counts, scaled for subsampling and, with SmrConfig.normalize,
+ * as counts per million reads of their sample (CPM) or per kilobase of
+ * molecule per million reads (RPKM), with molecule lengths from the @SQ LN:
+ * fields, or else from the reference index. Each sample's factor is computed
+ * once from its total, so a row costs one multiplication per count (see
+ * smr_normalize_row). With SmrConfig.withraw, each value is preceded by its
+ * raw count.
+ */
+typedef struct Normalizer Normalizer;
+struct Normalizer
+{
+  int method;
+  bool withraw;
+  double subsample;
+  const CountTable *lengths;
+  const ReferenceIndex *reference;
+  std::vector<double> factors;
+  bool fast;  // every count is below 2^52, see smr_normalize_row
+  std::vector<double> values;
+
+  Normalizer(const SmrConfig& config, const std::vector<uint64_t>& totals,
+             const CountTable *lengths, const ReferenceIndex *reference)
+    : method(config.normalize), withraw(config.withraw),
+      subsample(config.subsample), lengths(lengths), reference(reference),
+      fast(true)
+  {
+    double scale = method == SMR_NORMALIZE_RPKM ? 1e9 : 1e6;
+    for(uint64_t total : totals)
+    {
+      factors.push_back(total > 0 ? scale / total : 0.0);
+      fast = fast && total < (1ULL << 52);
+    }
+  }
+
+  // Normalized values of the row of molecule `molid`; NaN for RPKM if its
+  // length is unknown
+  const double *normalize(const char *molid, const uint64_t *counts,
+                          size_t n)
+  {
+    values.resize(n);
+    double rowfactor = 1.0;
+    if(method == SMR_NORMALIZE_RPKM)
+    {
+      uint64_t length = lengths->find(molid, strlen(molid));
+      if(length == 0 && reference != NULL)
+        length = reference->length(molid, strlen(molid));
+      if(length == 0)
+      {
+        std::fill(values.begin(), values.end(), NAN);
+        return values.data();
+      }
+      rowfactor = 1.0 / length;
+    }
+    if(fast)
+      smr_normalize_row(counts, factors.data(), rowfactor, values.data(), n);
+    else
+    {
+      for(size_t i = 0; i < n; i++)
+        values[i] = (double)counts[i] * factors[i] * rowfactor;
+    }
+    return values.data();
+  }
+
+  // Print the row of molecule `molid`, given its raw counts
+  void print_row(FILE *outstream, char delim, const char *molid,
+                 const uint64_t *counts, size_t n)
+  {
+    const double *normalized = NULL;
+    if(method != SMR_NORMALIZE_NONE)
+      normalized = normalize(molid, counts, n);
+    fprintf(outstream, "%s%c", molid, delim);
+    for(size_t i = 0; i < n; i++)
+    {
+      if(i > 0)
+        fputc(delim, outstream);
+      if(normalized == NULL || withraw)
+        fprintf(outstream, "%llu",
+                (unsigned long long)smr_scale(counts[i], subsample));
+      if(normalized == NULL)
+        continue;
+      if(withraw)
+        fputc(delim, outstream);
+      if(std::isnan(normalized[i]))
+        fputs("NA", outstream);
+      else
+        fprintf(outstream, "%.6g", normalized[i]);
+    }
+    fputc('\n', outstream);
+  }
+};
+
+
+/**
+ * @type SmrOutput
+ *
+ * Writes each tally out as soon as it is finished, so that thousands of
+ * samples can be counted without keeping their tables. Every molecule ID gets
+ * a row number the first time any tally counts it.
+ *
+ * Each tally's (row, count) pairs are sorted by row and appended to an
+ * unlinked spill file: first the rows, as 32-bit integers, then the counts,
+ * each as wide as the column's largest count needs (see CountColumn). close()
+ * then assembles the usual row-major matrix one block of rows at a time,
+ * sized to stay in cache, reading each column through a small buffer.
+ *
+ * In the transposed layout, close() instead writes a "#molecules" line naming
+ * every molecule, then one line per sample, in the order the samples were
+ * added: its name and its count of each molecule. Every line has the same
+ * columns, and neither their order nor the order of the lines depends on
+ * which sample finished first.
+ */
+#define SMR_ROW_BLOCK_SIZE (1 << 20)
+#define SMR_SPILL_BUFFER 512
+typedef struct SmrOutput SmrOutput;
+struct SmrOutput
+{
+  struct Entry
+  {
+    uint32_t row;
+    uint64_t count;
+  };
+
+  struct Column
+  {
+    off_t offset;
+    size_t length;
+    unsigned width;
+    size_t next;
+    std::vector<Entry> buffer;
+    size_t pos;
+    std::string name;
+
+    Column() : offset(0), length(0), width(2), next(0), pos(0) {}
+  };
+
+  FILE *outstream;
+  char delim;
+  bool transpose;
+  double subsample;
+  RowDictionary dictionary;
+  std::vector<uint64_t> totals;
+  int spillfd;
+  off_t spillsize;
+  std::vector<Column> columns;
+  std::mutex lock;
+  std::string error;  // the first spill file error
+
+  SmrOutput(FILE *outstream, char delim, const SmrConfig& config)
+    : outstream(outstream), delim(delim), transpose(config.transpose),
+      subsample(config.subsample), spillfd(-1), spillsize(0) {}
+
+  ~SmrOutput()
+  {
+    if(spillfd >= 0)
+      ::close(spillfd);
+  }
+
+  // Create the spill file; returns false on failure
+  bool open()
+  {
+    const char *dir = getenv("TMPDIR");
+    std::string path = std::string(dir && *dir ? dir : "/tmp") +
+                       "/smr-spill-XXXXXX";
+    spillfd = mkstemp(&path[0]);
+    if(spillfd < 0)
+      return false;
+    unlink(path.c_str());
+    return true;
+  }
+
+  uint32_t row(const char *molid, size_t len)
+  {
+    uint32_t r = dictionary.row(molid, len);
+    if(r >= totals.size())
+      totals.resize(dictionary.size(), 0);
+    return r;
+  }
+
+  void write(size_t sample, const ReadTally& readTally)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    dictionary.reserve(readTally.size());
+    std::vector<Entry> entries;
+    entries.reserve(readTally.size());
+    for(auto kvpair : readTally)
+    {
+      entries.push_back({row(kvpair.first, strlen(kvpair.first)),
+                         kvpair.second});
+      totals[entries.back().row] += kvpair.second;
+    }
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry& a, const Entry& b) { return a.row < b.row; });
+    if(sample >= columns.size())
+      columns.resize(sample + 1);
+    columns[sample].name = readTally.name;
+    spill(columns[sample], entries);
+  }
+
+  // Append the entries of a column, sorted by row, to the spill file
+  void spill(Column& column, const std::vector<Entry>& entries)
+  {
+    std::vector<uint32_t> rownums;
+    CountColumn counts;
+    for(auto& entry : entries)
+    {
+      rownums.push_back(entry.row);
+      counts.set(rownums.size() - 1, entry.count);
+    }
+    column.offset = spillsize;
+    column.length = entries.size();
+    column.width = counts.width;
+    spill_write(rownums.data(), rownums.size() * sizeof(uint32_t));
+    spill_write(counts.data.data(), counts.bytes());
+  }
+
+  void spill_write(const void *data, size_t len)
+  {
+    if(len > 0 && pwrite(spillfd, data, len, spillsize) != (ssize_t)len &&
+       error.empty())
+      error = std::string("error writing spill file: ") + strerror(errno);
+    spillsize += len;
+  }
+
+  // Read entries [first, first + n) of a spilled column into `entries`;
+  // returns false, setting `error`, if they cannot be read
+  bool spill_read(const Column& column, size_t first, size_t n,
+                  std::vector<Entry>& entries)
+  {
+    std::vector<uint32_t> rownums(n);
+    std::vector<char> counts(n * column.width);
+    ssize_t want = n * sizeof(uint32_t);
+    if(smr_pread_full(spillfd, (char *)rownums.data(), want,
+                      column.offset + first * sizeof(uint32_t)) != want ||
+       smr_pread_full(spillfd, counts.data(), counts.size(),
+                      column.offset + column.length * sizeof(uint32_t) +
+                      first * column.width) != (ssize_t)counts.size())
+    {
+      if(error.empty())
+        error = std::string("error reading spill file: ") + strerror(errno);
+      entries.clear();
+      return false;
+    }
+    entries.resize(n);
+    for(size_t i = 0; i < n; i++)
+    {
+      entries[i].row = rownums[i];
+      entries[i].count = CountColumn::load(&counts[i * column.width],
+                                           column.width);
+    }
+    return true;
+  }
+
+  bool refill(Column& column)
+  {
+    if(column.next == column.length)
+    {
+      std::vector<Entry>().swap(column.buffer);
+      return false;
+    }
+    size_t n = std::min((size_t)SMR_SPILL_BUFFER, column.length - column.next);
+    column.pos = 0;
+    if(!spill_read(column, column.next, n, column.buffer))
+    {
+      column.next = column.length;
+      return false;
+    }
+    column.next += n;
+    return true;
+  }
+
+  // Give every allowlisted molecule a row, in the order of the list, so that
+  // rows are printed in that order and listed molecules never seen still get
+  // a row of zeros
+  void add_rows(const IdAllowlist& ids)
+  {
+    for(size_t i = 0; i < ids.size(); i++)
+      row(ids[i], strlen(ids[i]));
+  }
+
+  // Write the transposed layout: the column names, then each sample's line,
+  // filled in from its spilled column
+  bool write_transposed(const std::vector<uint32_t>& perm)
+  {
+    size_t numrows = dictionary.size();
+    fputs("#molecules", outstream);
+    for(size_t r = 0; r < numrows; r++)
+      fprintf(outstream, "%c%s", delim, dictionary[perm.empty() ? r : perm[r]]);
+    fputc('\n', outstream);
+    std::vector<uint64_t> counts(numrows);
+    for(auto& column : columns)
+    {
+      std::fill(counts.begin(), counts.end(), 0);
+      for(; column.pos < column.buffer.size() || refill(column); column.pos++)
+        counts[column.buffer[column.pos].row] = column.buffer[column.pos].count;
+      fputs(column.name.c_str(), outstream);
+      for(uint64_t count : counts)
+        fprintf(outstream, "%c%llu", delim,
+                (unsigned long long)smr_scale(count, subsample));
+      fputc('\n', outstream);
+    }
+    return error.empty();
+  }
+
+  // Renumber the spilled rows in printing order, rewriting each column
+  // sorted by its new row numbers at the end of the spill file
+  void reorder(const std::vector<uint32_t>& perm)
+  {
+    std::vector<uint32_t> rank(perm.size());
+    for(uint32_t i = 0; i < perm.size(); i++)
+      rank[perm[i]] = i;
+    for(auto& column : columns)
+    {
+      if(column.length == 0)
+        continue;
+      std::vector<Entry> entries;
+      if(!spill_read(column, 0, column.length, entries))
+        return;
+      for(auto& entry : entries)
+        entry.row = rank[entry.row];
+      std::sort(entries.begin(), entries.end(),
+                [](const Entry& a, const Entry& b) { return a.row < b.row; });
+      spill(column, entries);
+    }
+  }
+
+  // Write the matrix, with rows (or for the transposed layout, columns) in
+  // the order given by `perm` (see RowOrder); returns false if the spill file
+  // could not be written or read back
+  bool close(size_t numsamples, const std::vector<uint32_t>& perm,
+             Normalizer& normalizer)
+  {
+    columns.resize(numsamples);
+    if(!perm.empty())
+      reorder(perm);
+    if(!error.empty())
+      return false;
+    if(transpose)
+      return write_transposed(perm);
+    size_t numrows = dictionary.size();
+    size_t blockrows = std::max((size_t)1, SMR_ROW_BLOCK_SIZE /
+                                (std::max(numsamples, (size_t)1) *
+                                 sizeof(uint64_t)));
+    std::vector<uint64_t> block(blockrows * numsamples);
+    for(size_t first = 0; first < numrows; first += blockrows)
+    {
+      size_t last = std::min(first + blockrows, numrows);
+      std::fill(block.begin(), block.end(), 0);
+      for(size_t j = 0; j < numsamples; j++)
+      {
+        Column& column = columns[j];
+        while(column.pos < column.buffer.size() || refill(column))
+        {
+          const Entry& entry = column.buffer[column.pos];
+          if(entry.row >= last)
+            break;
+          block[(entry.row - first) * numsamples + j] = entry.count;
+          column.pos++;
+        }
+      }
+
+      for(size_t r = first; r < last; r++)
+        normalizer.print_row(outstream, delim,
+                             dictionary[perm.empty() ? r : perm[r]],
+                             &block[(r - first) * numsamples], numsamples);
+    }
+    return error.empty();
+  }
+};
+
+
+/**
+ * @class ReadTallyMatrix
+ *
+ * This class is an instance of a vector, where the vector elements are
+ * ReadTally objects (described above). Each row in the matrix corresponds to a
+ * molecule, and each column corresponds to one sample, in the order the
+ * samples were added.
+ *
+ * In approximate or subsampling mode, printed counts are preceded by comment
+ * lines (starting with '#') that describe their error.
+ *
+ * Tasks run on the pool of `engine` if there is one, or on a pool started by
+ * the matrix the first time it is needed. With an engine, tallies are
+ * presized for the molecules it has seen, and teach it any new ones.
+ *
+ * Each tally is finished as soon as its last task is done. If an output
+ * stream has been set, the tally is then written out and released (see
+ * SmrOutput), so that only the molecule IDs stay in memory. Otherwise, unless
+ * counts are approximate, its counts are moved into a CountColumn over rows
+ * shared by every sample and its table is released, so that each molecule ID
+ * is kept once and most counts take 2 bytes, or 6 with the row of a sparse
+ * column.
+ */
+typedef struct ReadTallyMatrix ReadTallyMatrix;
+struct ReadTallyMatrix : public std::vector<ReadTally>
+{
+  SmrConfig config;
+  BlockReaderOptions io;
+  SmrEngine *engine;
+  std::unique_ptr<WorkStealingPool> ownpool;
+  size_t expected;
+  std::unique_ptr<SmrOutput> output;
+  RowDictionary dictionary;
+  std::vector<CountColumn> columns;
+  CountTable lengths;  // molecule ID -> length, from the first @SQ line
+  std::mutex columnlock;  // guards dictionary, columns and lengths
+  std::unique_ptr<IdAllowlist> ids;
+  std::unique_ptr<ReferenceIndex> reference;
+  bool regions;  // `ids` are regions, see smr_counter_set_regions()
+  std::string checkpoint;
+  std::string snapshot;
+  char snapshotdelim;
+  int snapshotrequested;
+  RowOrder order;
+  std::string error;
+
+  ReadTallyMatrix(const SmrConfig& config, SmrEngine *engine = NULL)
+    : config(config), engine(engine), expected(0), regions(false),
+      snapshotdelim(','),
+      snapshotrequested(0), order(config.sort)
+  {
+    if(engine != NULL)
+    {
+      this->config.numthreads = engine->pool.numthreads;
+      expected = engine->size();
+    }
+    io.depth = config.iodepth;
+    io.blocksize = config.iobuffer;
+    io.engine = config.ioengine;
+    io.dropcache = config.dropcache;
+  }
+
+  WorkStealingPool& workers()
+  {
+    if(engine != NULL)
+      return engine->pool;
+    if(!ownpool)
+      ownpool.reset(new WorkStealingPool(config.numthreads));
+    return *ownpool;
+  }
+
+  // Finish sample `i`, then hand it to the engine and the output, if any
+  void finish_sample(size_t i)
+  {
+    ReadTally& readTally = (*this)[i];
+    readTally.finish(config);
+    if(!checkpoint.empty() && !readTally.restored)
+    {
+      std::string path = Checkpoint::tally_path(checkpoint, readTally.key);
+      if(Checkpoint::save(path, readTally, 0, readTally.filesize,
+                          readTally.headerids))
+        Checkpoint::remove_chunks(checkpoint, readTally.key);
+      else if(readTally.error.empty())
+        readTally.error = checkpoint_error(path);
+    }
+    if(!readTally.headerids.empty())
+    {
+      order.learn_header(i, readTally.headerids);
+      std::vector<char>().swap(readTally.headerids);
+    }
+    if(readTally.lengths.size() > 0)
+    {
+      std::lock_guard<std::mutex> guard(columnlock);
+      for(auto kvpair : readTally.lengths)
+      {
+        size_t len = strlen(kvpair.first);
+        if(lengths.find(kvpair.first, len) == 0)
+          lengths.increment(kvpair.first, len, smr_hash(kvpair.first, len),
+                            kvpair.second);
+      }
+      readTally.lengths = CountTable(16);
+    }
+    if(engine != NULL)
+      engine->learn(readTally);
+    if(output)
+    {
+      output->write(i, readTally);
+      readTally.release();
+    }
+    else if(!config.approx)
+      store_sample(i);
+  }
+
+  // Move the counts of finished sample `i` into its column and free its
+  // table. Only numbering the rows needs the lock.
+  void store_sample(size_t i)
+  {
+    ReadTally& readTally = (*this)[i];
+    std::vector<uint32_t> rownums;
+    rownums.reserve(readTally.size());
+    {
+      std::lock_guard<std::mutex> guard(columnlock);
+      dictionary.reserve(readTally.size());
+      for(auto kvpair : readTally)
+        rownums.push_back(dictionary.row(kvpair.first, strlen(kvpair.first)));
+    }
+    CountColumn column;
+    if(!rownums.empty())
+      column.resize(*std::max_element(rownums.begin(), rownums.end()) + 1);
+    size_t k = 0;
+    for(auto kvpair : readTally)
+      column.set(rownums[k++], kvpair.second);
+    readTally.release();
+    column.compact();
+
+    std::lock_guard<std::mutex> guard(columnlock);
+    if(i >= columns.size())
+      columns.resize(i + 1);
+    std::swap(columns[i], column);
+  }
+
+  std::vector<uint64_t> sample_totals() const
+  {
+    std::vector<uint64_t> totals;
+    for(auto& readTally : *this)
+      totals.push_back(readTally.total);
+    return totals;
+  }
+
+  // Unscaled counts of one molecule in every sample
+  void molecule_counts(const char *molid, size_t len, uint64_t *counts) const
+  {
+    size_t r = dictionary.find(molid, len);
+    for(size_t i = 0; i < this->size(); i++)
+    {
+      if(config.approx)
+        counts[i] = (*this)[i].count(molid, len);
+      else
+        counts[i] = i < columns.size() ? columns[i][r] : 0;
+    }
+  }
+
+  // Compute the checkpoint key of sample `i` from its file and the options
+  // that change its counts, and load its counts if they were saved by an
+  // earlier run; returns false if they were not
+  bool restore_sample(size_t i)
+  {
+    ReadTally& readTally = (*this)[i];
+    struct stat info;
+    char path[PATH_MAX];
+    if(stat(readTally.name.c_str(), &info) != 0 ||
+       realpath(readTally.name.c_str(), path) == NULL)
+      return false;
+    std::string identity = std::string(path) + '\0' +
+                           std::to_string(info.st_size) + '\0' +
+                           std::to_string(info.st_mtim.tv_sec) + '.' +
+                           std::to_string(info.st_mtim.tv_nsec) + '\0' +
+                           std::to_string(config.subsample) + '\0' +
+                           std::to_string(config.sort == SMR_SORT_HEADER);
+    for(size_t j = 0; ids && j < ids->size(); j++)
+      identity += std::string("\0", 1) + (*ids)[j];
+    readTally.key = smr_hash(identity.c_str(), identity.length());
+
+    Checkpoint saved;
+    if(!saved.load(Checkpoint::tally_path(checkpoint, readTally.key)))
+      return false;
+    if(config.normalize == SMR_NORMALIZE_RPKM)
+      readTally.read_header(config);  // for the @SQ lengths
+    std::swap(static_cast<CountTable&>(readTally), saved.counts);
+    readTally.headerids.swap(saved.headerids);
+    readTally.filesize = saved.end;
+    readTally.ready = true;
+    readTally.restored = true;
+    readTally.progress.bytes = saved.end;
+    readTally.merged = saved.end;
+    finish_sample(i);
+    return true;
+  }
+
+  // Count the files of samples [first, size()). Headers are read and chunks
+  // counted on a work-stealing pool of `numthreads` threads. Each task's
+  // counts are reduced into its sample's tally under a per-sample lock.
+  //
+  // With a checkpoint directory, files are always split into chunks, and the
+  // counts of each chunk, then of each whole file, are saved as soon as they
+  // are done (see Checkpoint). Files and chunks saved by an earlier run are
+  // loaded rather than counted again.
+  bool count_files(size_t first)
+  {
+    std::vector<size_t> samples;
+    for(size_t i = first; i < this->size(); i++)
+      samples.push_back(i);
+    workers().run(samples, [this](size_t i) {
+      if(checkpoint.empty() || !restore_sample(i))
+        (*this)[i].read_header(config);
+    });
+    for(size_t i : samples)
+    {
+      if(!(*this)[i].error.empty())
+      {
+        error = (*this)[i].error;
+        return false;
+      }
+    }
+
+    std::vector<TallyTask> tasks;
+    for(size_t i : samples)
+    {
+      ReadTally& readTally = (*this)[i];
+      if(readTally.restored)
+        continue;
+      if(readTally.bam)
+      {
+        for(auto& span : readTally.spans)
+          tasks.push_back({i, (off_t)span.first, (off_t)span.second});
+        continue;
+      }
+      bool split = config.numthreads > 1 || !checkpoint.empty() ||
+                   !snapshot.empty();
+      off_t chunksize = split ? (off_t)config.chunksize : readTally.filesize;
+      off_t begin = readTally.bodyoffset;
+      do
+      {
+        off_t end = std::min(begin + chunksize, readTally.filesize);
+        tasks.push_back({i, begin, end});
+        begin = end;
+      } while(begin < readTally.filesize);
+    }
+    std::stable_sort(tasks.begin(), tasks.end(),
+                     [this](const TallyTask& a, const TallyTask& b) {
+      return task_bytes(a) > task_bytes(b);
+    });
+
+    std::vector<std::mutex> locks(this->size());
+    std::vector<size_t> remaining(this->size());
+    for(auto& task : tasks)
+      remaining[task.sample]++;
+    std::mutex monitorlock;
+    std::condition_variable monitorwake;
+    bool counting = true;
+    std::thread monitor;
+    if(config.progress > 0 || !snapshot.empty())
+    {
+      monitor = std::thread([&, first]() {
+        monitor_files(first, locks, monitorlock, monitorwake, counting);
+      });
+    }
+
+    uint64_t keep = smr_subsample_threshold(config.subsample);
+    workers().run(tasks, [this, &locks, &remaining, keep](TallyTask& task) {
+      ReadTally& readTally = (*this)[task.sample];
+      TallyWorker worker(readTally.index.get(), readTally.shared.get(),
+                         readTally.sketch.get(), config.toplist,
+                         config.numthreads > 1, keep, readTally.ids,
+                         config.batchsize);
+      readTally.presize(worker, task_bytes(task));
+      worker.progress = &readTally.progress;
+      worker.use_reference(readTally.reference);
+      std::string failure;
+      if(checkpoint.empty())
+        failure = count_task(worker, task);
+      else
+      {
+        std::string path = Checkpoint::chunk_path(checkpoint, readTally.key,
+                                                  task.begin);
+        Checkpoint saved;
+        if(saved.load(path) && saved.begin == (uint64_t)task.begin &&
+           saved.end == (uint64_t)task.end)
+          std::swap(worker.local, saved.counts);
+        else
+        {
+          failure = count_task(worker, task);
+          worker.fold_reference();
+          if(failure.empty() &&
+             !Checkpoint::save(path, worker.local, task.begin, task.end,
+                               std::vector<char>()))
+            failure = checkpoint_error(path);
+        }
+      }
+      std::lock_guard<std::mutex> guard(locks[task.sample]);
+      if(!failure.empty() && readTally.error.empty())
+        readTally.error = failure;
+      readTally.merge_worker(worker);
+      if(!readTally.index && !readTally.shared && !readTally.sketch)
+        readTally.merged += task_bytes(task);
+      if(--remaining[task.sample] == 0 && readTally.error.empty())
+        finish_sample(task.sample);
+    });
+    if(monitor.joinable())
+    {
+      {
+        std::lock_guard<std::mutex> guard(monitorlock);
+        counting = false;
+      }
+      monitorwake.notify_all();
+      monitor.join();
+    }
+    for(size_t i : samples)
+    {
+      if(!(*this)[i].error.empty())
+      {
+        error = (*this)[i].error;
+        return false;
+      }
+    }
+    if(output && !output->error.empty())
+    {
+      error = output->error;
+      return false;
+    }
+    return true;
+  }
+
+  static std::string checkpoint_error(const std::string& path)
+  {
+    return "error writing checkpoint " + path + ": " + strerror(errno);
+  }
+
+  // Count the range of `task` with `worker`; returns an error message, or an
+  // empty string on success
+  std::string count_task(TallyWorker& worker, const TallyTask& task)
+  {
+    ReadTally& readTally = (*this)[task.sample];
+    if(readTally.bam)
+    {
+      if(!worker.count_bam(readTally.name.c_str(), task.begin, task.end,
+                           readTally.refnames))
+        return "error reading BAM file " + readTally.name;
+      return "";
+    }
+    if(!worker.count(readTally.name.c_str(), task.begin, task.end,
+                     readTally.bodyoffset, io))
+      return "error reading file " + readTally.name + ": " + strerror(errno);
+    return "";
+  }
+
+  // Bytes of the file read by a task; for a BAM span, its compressed size
+  uint64_t task_bytes(const TallyTask& task) const
+  {
+    if((*this)[task.sample].bam)
+      return ((uint64_t)task.end >> 16) - ((uint64_t)task.begin >> 16);
+    return task.end - task.begin;
+  }
+
+  // While samples [first, size()) are counted, report progress on stderr
+  // every config.progress seconds, and write a snapshot whenever one is
+  // requested, until `counting` is cleared
+  void monitor_files(size_t first, std::vector<std::mutex>& locks,
+                     std::mutex& lock, std::condition_variable& wake,
+                     bool& counting)
+  {
+    auto start = std::chrono::steady_clock::now();
+    auto lastreport = start;
+    uint64_t lastrecords = 0;
+    std::unique_lock<std::mutex> guard(lock);
+    while(counting)
+    {
+      wake.wait_for(guard, std::chrono::milliseconds(100));
+      if(__atomic_exchange_n(&snapshotrequested, 0, __ATOMIC_RELAXED))
+        write_snapshot(locks);
+      auto now = std::chrono::steady_clock::now();
+      if(config.progress > 0 &&
+         (!counting || now - lastreport >= std::chrono::seconds(
+                                              config.progress)))
+      {
+        lastrecords = report_progress(first, now - start, now - lastreport,
+                                      lastrecords, !counting);
+        lastreport = now;
+      }
+    }
+  }
+
+  // Print one progress line for samples [first, size()), then one line per
+  // file still being read; returns the number of records read so far
+  uint64_t report_progress(size_t first, std::chrono::duration<double> elapsed,
+                           std::chrono::duration<double> interval,
+                           uint64_t lastrecords, bool final)
+  {
+    uint64_t total = 0, read = 0, records = 0;
+    size_t finished = 0;
+    for(size_t i = first; i < this->size(); i++)
+    {
+      ReadTally& readTally = (*this)[i];
+      total += readTally.filesize - readTally.bodyoffset;
+      read += __atomic_load_n(&readTally.progress.bytes, __ATOMIC_RELAXED);
+      records += __atomic_load_n(&readTally.progress.records,
+                                 __ATOMIC_RELAXED);
+      finished += __atomic_load_n(&readTally.done, __ATOMIC_RELAXED);
+    }
+    double rate = read / std::max(elapsed.count(), 1e-3);
+    fprintf(stderr, "progress: %zu of %zu files, %.1f of %.1f MB (%.0f%%), "
+            "%.0f records/s", finished, this->size() - first, read / 1048576.0,
+            total / 1048576.0, total ? 100.0 * read / total : 100.0,
+            (records - lastrecords) / std::max(interval.count(), 1e-3));
+    if(final)
+      fprintf(stderr, ", done in %.1f s\n", elapsed.count());
+    else if(read > 0 && read < total)
+    {
+      unsigned long eta = (total - read) / rate;
+      fprintf(stderr, ", ETA %lu:%02lu:%02lu\n", eta / 3600, eta / 60 % 60,
+              eta % 60);
+    }
+    else
+      fprintf(stderr, "\n");
+
+    for(size_t i = first; i < this->size() && !final; i++)
+    {
+      ReadTally& readTally = (*this)[i];
+      uint64_t size = readTally.filesize - readTally.bodyoffset;
+      uint64_t bytes = __atomic_load_n(&readTally.progress.bytes,
+                                       __ATOMIC_RELAXED);
+      if(bytes > 0 && bytes < size)
+        fprintf(stderr, "  %s: %.1f of %.1f MB (%.0f%%)\n",
+                readTally.name.c_str(), bytes / 1048576.0, size / 1048576.0,
+                100.0 * bytes / size);
+    }
+    return records;
+  }
+
+  // Write the counts gathered so far to the snapshot file, replacing it
+  // atomically. Each sample is copied under its lock, so the snapshot holds
+  // whole chunks only: finished files in full, and for the others the chunks
+  // already merged into their tallies. Chunks counted in a header index,
+  // shared table or sketch are only merged when their file is finished. The
+  // '#counted' line gives the bytes of each file covered. A finished sample
+  // stores its column while holding its own lock and then the column lock,
+  // so the columns are read in a second pass, never holding both.
+  void write_snapshot(std::vector<std::mutex>& locks)
+  {
+    std::vector<CountTable> tables(this->size());
+    std::vector<uint64_t> covered(this->size(), 0);
+    std::vector<bool> stored(this->size(), false);
+    size_t finished = 0;
+    for(size_t i = 0; i < this->size(); i++)
+    {
+      std::lock_guard<std::mutex> guard(locks[i]);
+      ReadTally& readTally = (*this)[i];
+      if(readTally.done)
+      {
+        finished++;
+        covered[i] = readTally.filesize - readTally.bodyoffset;
+      }
+      else
+        covered[i] = readTally.merged;
+      if(readTally.done && !config.approx)
+        stored[i] = true;
+      else if(covered[i] > 0)
+        tables[i] = readTally;
+    }
+    {
+      std::lock_guard<std::mutex> guard(columnlock);
+      for(size_t i = 0; i < this->size() && i < columns.size(); i++)
+      {
+        if(!stored[i])
+          continue;
+        const CountColumn& column = columns[i];
+        tables[i].reserve(column.size());
+        for(size_t k = 0; k < column.size(); k++)
+        {
+          const char *molid = dictionary[column.row(k)];
+          size_t len = strlen(molid);
+          if(column.count(k) > 0)
+            tables[i].increment(molid, len, smr_hash(molid, len),
+                                column.count(k));
+        }
+      }
+    }
+
+    std::unordered_set<std::string> unique;
+    for(auto& table : tables)
+    {
+      unique.reserve(table.size());
+      for(auto kvpair : table)
+        unique.emplace(kvpair.first);
+    }
+    std::string temp = snapshot + ".tmp";
+    FILE *out = fopen(temp.c_str(), "w");
+    if(out == NULL)
+    {
+      fprintf(stderr, "error writing snapshot %s: %s\n", temp.c_str(),
+              strerror(errno));
+      return;
+    }
+    fprintf(out, "#snapshot: %zu of %zu files finished; the #counted line "
+            "gives the bytes of each file whose reads are included\n",
+            finished, this->size());
+    fprintf(out, "#counted");
+    for(uint64_t bytes : covered)
+      fprintf(out, "%c%llu", snapshotdelim, (unsigned long long)bytes);
+    fprintf(out, "\n");
+    for(auto& molid : unique)
+    {
+      fprintf(out, "%s", molid.c_str());
+      for(auto& table : tables)
+        fprintf(out, "%c%llu", snapshotdelim, (unsigned long long)
+                scale(table.find(molid.c_str(), molid.length())));
+      fprintf(out, "\n");
+    }
+    if(fclose(out) != 0 || rename(temp.c_str(), snapshot.c_str()) != 0)
+      fprintf(stderr, "error writing snapshot %s: %s\n", snapshot.c_str(),
+              strerror(errno));
+  }
+
+  // Finish every sample and, if an output stream was set, write it out;
+  // returns false if a checkpoint or the spill file could not be written
+  bool finish()
+  {
+    std::vector<size_t> samples;
+    for(size_t i = 0; i < this->size(); i++)
+      samples.push_back(i);
+    workers().run(samples, [this](size_t i) {
+      if(!(*this)[i].done)
+        finish_sample(i);
+    });
+    for(auto& readTally : *this)
+    {
+      if(!readTally.error.empty())
+      {
+        error = readTally.error;
+        return false;
+      }
+    }
+    if(output)
+    {
+      // Transposed columns are numbered as samples finish, so without a sort
+      // order or an allowlist to fix them they are sorted by name
+      if(output->transpose && order.sort == SMR_SORT_NONE && !ids)
+        order.sort = SMR_SORT_NAME;
+      std::vector<uint32_t> perm = order.permutation(
+          output->dictionary.molids(), output->totals, workers());
+      Normalizer normalizer(config, sample_totals(), &lengths,
+                            reference.get());
+      if(!output->close(this->size(), perm, normalizer))
+      {
+        error = output->error;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  uint64_t scale(double count) const
+  {
+    return smr_scale(count, config.subsample);
+  }
+
+  // Gather the molecules counted in any sample (or every molecule of the
+  // allowlist, in its order), in printing order
+  void row_names(std::vector<std::string>& molids)
+  {
+    molids.clear();
+    if(ids)
+    {
+      for(size_t i = 0; i < ids->size(); i++)
+        molids.emplace_back((*ids)[i]);
+    }
+    else if(!config.approx)
+    {
+      for(size_t r = 0; r < dictionary.size(); r++)
+        molids.emplace_back(dictionary[r]);
+    }
+    else
+    {
+      std::unordered_set<std::string> unique;
+      for(auto& readTally : *this)
+      {
+        unique.reserve(readTally.size());
+        for(auto kvpair : readTally)
+          unique.emplace(kvpair.first);
+      }
+      molids.assign(unique.begin(), unique.end());
+    }
+
+    std::vector<const char *> names;
+    std::vector<uint64_t> totals;
+    std::vector<uint64_t> counts(this->size());
+    for(auto& molid : molids)
+    {
+      molecule_counts(molid.c_str(), molid.length(), counts.data());
+      uint64_t total = 0;
+      for(uint64_t count : counts)
+        total += count;
+      names.push_back(molid.c_str());
+      totals.push_back(total);
+    }
+    std::vector<uint32_t> perm = order.permutation(names, totals, workers());
+    if(!perm.empty())
+    {
+      std::vector<std::string> sorted(molids.size());
+      for(size_t i = 0; i < perm.size(); i++)
+        sorted[i].swap(molids[perm[i]]);
+      molids.swap(sorted);
+    }
+  }
+
+  std::vector<uint64_t> error_bounds() const
+  {
+    std::vector<uint64_t> bounds;
+    for(size_t i = 0; config.approx && i < this->size(); i++)
+      bounds.push_back(scale(ceil((*this)[i].sketch->error_bound())));
+    return bounds;
+  }
+
+  // Gather the row names, as row_names() does, their scaled counts and, with
+  // config.normalize, their normalized values
+  void rows(std::vector<std::string>& molids, std::vector<uint64_t>& counts,
+            std::vector<uint64_t>& bounds, std::vector<double>& values)
+  {
+    row_names(molids);
+    Normalizer normalizer(config, sample_totals(), &lengths,
+                          reference.get());
+    counts.resize(molids.size() * this->size());
+    values.clear();
+    uint64_t *count = counts.data();
+    for(auto& molid : molids)
+    {
+      molecule_counts(molid.c_str(), molid.length(), count);
+      if(config.normalize != SMR_NORMALIZE_NONE)
+      {
+        const double *normalized = normalizer.normalize(molid.c_str(), count,
+                                                        this->size());
+        values.insert(values.end(), normalized, normalized + this->size());
+      }
+      for(size_t i = 0; i < this->size(); i++, count++)
+        *count = scale(*count);
+    }
+    bounds = error_bounds();
+  }
+
+  void print_error_bounds(FILE *outstream, char delim,
+                          const std::vector<uint64_t>& bounds) const
+  {
+    double subsample = config.subsample;
+    if(subsample < 1.0)
+    {
+      fprintf(outstream, "#subsample: reads kept by QNAME hash with "
+              "probability %g, counts scaled by %g; the standard error of a "
+              "scaled count C is about sqrt(C*%g), or sqrt(2*C*%g) when both "
+              "mates map to the molecule\n", subsample, 1.0 / subsample,
+              (1.0 - subsample) / subsample, (1.0 - subsample) / subsample);
+    }
+    if(config.approx && !this->empty())
+    {
+      fprintf(outstream, "#approx: count-min sketch, %d rows of %lu counters; "
+              "no count is underestimated, and each count exceeds the true "
+              "count by at most the bound below with probability %g\n",
+              SMR_SKETCH_DEPTH, (unsigned long)(*this)[0].sketch->width,
+              1.0 - CountMinSketch::failure());
+      fprintf(outstream, "#bound");
+      for(uint64_t bound : bounds)
+        fprintf(outstream, "%c%llu", delim, (unsigned long long)bound);
+      fprintf(outstream, "\n");
+    }
+    if(config.normalize != SMR_NORMALIZE_NONE)
+    {
+      bool rpkm = config.normalize == SMR_NORMALIZE_RPKM;
+      fprintf(outstream, "#normalize: %s per million reads counted in each "
+              "sample%s%s\n", rpkm ? "RPKM, reads per kilobase of molecule "
+              "(@SQ LN:)" : "CPM, reads", rpkm ? "; NA where no @SQ line or "
+              "index gives the length" : "",
+              config.withraw ? "; each value follows its raw count" : "");
+    }
+  }
+
+  // Print the matrix one row at a time, without gathering it in memory
+  void print(FILE *outstream, char delim)
+  {
+    std::vector<std::string> molids;
+    row_names(molids);
+    print_error_bounds(outstream, delim, error_bounds());
+
+    Normalizer normalizer(config, sample_totals(), &lengths,
+                          reference.get());
+    std::vector<uint64_t> counts(this->size());
+    for(auto& molid : molids)
+    {
+      molecule_counts(molid.c_str(), molid.length(), counts.data());
+      normalizer.print_row(outstream, delim, molid.c_str(), counts.data(),
+                           this->size());
+    }
+  }
+};
+
+
+/**
+ * @type SmrCounter
+ *
+ * The object behind the C API: a tally matrix, plus the storage for its last
+ * export.
+ */
+struct SmrCounter
+{
+  ReadTallyMatrix matrix;
+  bool finished;
+  FILE *outstream;
+  char delim;
+  std::vector<std::string> molids;
+  std::vector<const char *> molidptrs;
+  std::vector<uint64_t> counts;
+  std::vector<uint64_t> bounds;
+  std::vector<double> values;
+
+  SmrCounter(const SmrConfig& config, SmrEngine *engine = NULL)
+    : matrix(config, engine), finished(false), outstream(NULL), delim(',') {}
+
+  bool check_streamed()
+  {
+    if(matrix.output)
+    {
+      matrix.error = "error: counts have already been written to the output";
+      return false;
+    }
+    return true;
+  }
+
+  bool check_open(int sample)
+  {
+    if(finished)
+    {
+      matrix.error = "error: counter is already finished";
+      return false;
+    }
+    if(sample < 0 || (size_t)sample >= matrix.size())
+    {
+      matrix.error = "error: no sample " + std::to_string(sample);
+      return false;
+    }
+    return true;
+  }
+};
+
+
+static ssize_t smr_bgzf_write(void *cookie, const char *data, size_t len)
+{
+  ((BgzfWriter *)cookie)->write(data, len);
+  return len;
+}
+
+static int smr_bgzf_close(void *cookie)
+{
+  BgzfWriter *writer = (BgzfWriter *)cookie;
+  writer->close();
+  int status = ::close(writer->fd);
+  delete writer;
+  return status;
+}
+
+
+extern "C" {
+
+void smr_config_init(SmrConfig *config)
+{
+  config->batchsize   = 32;
+  config->perfecthash = 0;
+  config->numthreads  = 1;
+  config->sharedtable = 0;
+  config->chunksize   = 64 << 20;
+  config->iodepth     = 4;
+  config->iobuffer    = 1 << 20;
+  config->ioengine    = SMR_IO_AUTO;
+  config->dropcache   = 0;
+  config->approx      = 0;
+  config->sketchwidth = 1 << 20;
+  config->toplist     = 1000;
+  config->subsample   = 1.0;
+  config->spill       = 0;
+  config->transpose   = 0;
+  config->sort        = SMR_SORT_NONE;
+  config->progress    = 0;
+  config->normalize   = SMR_NORMALIZE_NONE;
+  config->withraw     = 0;
+}
+
+static bool smr_config_valid(const SmrConfig *config)
+{
+  return config->batchsize >= 1 && config->batchsize <= SMR_MAX_BATCH &&
+         config->numthreads >= 1 && config->chunksize >= 1 &&
+         config->iodepth >= 1 && config->iobuffer >= 4096 &&
+         config->sketchwidth >= 1 && config->toplist >= 1 &&
+         config->subsample > 0.0 && config->subsample <= 1.0 &&
+         !(config->approx && (config->spill || config->transpose)) &&
+         config->normalize >= SMR_NORMALIZE_NONE &&
+         config->normalize <= SMR_NORMALIZE_RPKM &&
+         !(config->normalize != SMR_NORMALIZE_NONE &&
+           (config->approx || config->transpose));
+}
+
+SmrCounter *smr_counter_new(const SmrConfig *config)
+{
+  if(!smr_config_valid(config))
+    return NULL;
+  return new SmrCounter(*config);
+}
+
+SmrEngine *smr_engine_new(unsigned numthreads)
+{
+  if(numthreads < 1)
+    return NULL;
+  return new SmrEngine(numthreads);
+}
+
+void smr_engine_free(SmrEngine *engine)
+{
+  delete engine;
+}
+
+size_t smr_engine_dictionary_size(SmrEngine *engine)
+{
+  return engine->size();
+}
+
+SmrCounter *smr_counter_new_warm(SmrEngine *engine, const SmrConfig *config)
+{
+  if(!smr_config_valid(config))
+    return NULL;
+  return new SmrCounter(*config, engine);
+}
+
+void smr_counter_free(SmrCounter *counter)
+{
+  delete counter;
+}
+
+const char *smr_counter_error(const SmrCounter *counter)
+{
+  return counter->matrix.error.c_str();
+}
+
+int smr_counter_add_sample(SmrCounter *counter, const char *name)
+{
+  ReadTallyMatrix& matrix = counter->matrix;
+  if(counter->finished)
+  {
+    matrix.error = "error: counter is already finished";
+    return -1;
+  }
+  size_t expected = matrix.expected;
+  if(matrix.ids)
+    expected = std::min(expected, matrix.ids->size());
+  matrix.emplace_back(name, expected, matrix.ids.get());
+  matrix.back().reference = matrix.reference.get();
+  matrix.back().regions = matrix.regions;
+  return matrix.size() - 1;
+}
+
+int smr_counter_count_files(SmrCounter *counter, const char *const *filenames,
+                            unsigned numfiles)
+{
+  size_t first = counter->matrix.size();
+  for(unsigned i = 0; i < numfiles; i++)
+  {
+    if(smr_counter_add_sample(counter, filenames[i]) < 0)
+      return -1;
+  }
+  return counter->matrix.count_files(first) ? 0 : -1;
+}
+
+int smr_counter_push_buffer(SmrCounter *counter, int sample, const char *data,
+                            size_t len)
+{
+  if(!counter->check_open(sample))
+    return -1;
+  counter->matrix[sample].push_buffer(data, len, counter->matrix.config);
+  return 0;
+}
+
+int smr_counter_push_record(SmrCounter *counter, int sample, const char *line,
+                            size_t len)
+{
+  if(!counter->check_open(sample))
+    return -1;
+  ReadTally& readTally = counter->matrix[sample];
+  if(!readTally.carry.empty())
+    readTally.push_buffer("\n", 1, counter->matrix.config);
+  if(len > 0 && line[len - 1] == '\n')
+    len--;
+  readTally.push_line(line, line + len, counter->matrix.config, false);
+  return 0;
+}
+
+int smr_counter_finish(SmrCounter *counter)
+{
+  if(!counter->finished)
+  {
+    counter->finished = true;
+    if(!counter->matrix.finish())
+      return -1;
+    if(counter->outstream != NULL && !counter->matrix.output)
+      counter->matrix.print(counter->outstream, counter->delim);
+  }
+  return 0;
+}
+
+int smr_counter_set_output(SmrCounter *counter, FILE *outstream, char delim)
+{
+  ReadTallyMatrix& matrix = counter->matrix;
+  if(counter->outstream != NULL || !matrix.empty())
+  {
+    matrix.error = "error: output must be set once, before adding samples";
+    return -1;
+  }
+  counter->outstream = outstream;
+  counter->delim = delim;
+  if(!matrix.config.spill && !matrix.config.transpose)
+    return 0;
+
+  matrix.output.reset(new SmrOutput(outstream, delim, matrix.config));
+  if(!matrix.output->open())
+  {
+    matrix.error = std::string("error creating spill file: ") +
+                   strerror(errno);
+    matrix.output.reset();
+    return -1;
+  }
+  if(matrix.ids)
+    matrix.output->add_rows(*matrix.ids);
+  std::vector<uint64_t> bounds;
+  matrix.print_error_bounds(outstream, delim, bounds);
+  return 0;
+}
+
+int smr_counter_export(SmrCounter *counter, SmrMatrix *matrix)
+{
+  if(!counter->check_streamed() || smr_counter_finish(counter) < 0)
+    return -1;
+  counter->matrix.rows(counter->molids, counter->counts, counter->bounds,
+                       counter->values);
+  counter->molidptrs.clear();
+  for(auto& molid : counter->molids)
+    counter->molidptrs.push_back(molid.c_str());
+
+  matrix->numrows = counter->molids.size();
+  matrix->numsamples = counter->matrix.size();
+  matrix->molids = counter->molidptrs.data();
+  matrix->counts = counter->counts.data();
+  matrix->bounds = counter->bounds.empty() ? NULL : counter->bounds.data();
+  matrix->values = counter->matrix.config.normalize == SMR_NORMALIZE_NONE ?
+                   NULL : counter->values.data();
+  return 0;
+}
+
+int smr_counter_print(SmrCounter *counter, FILE *outstream, char delim)
+{
+  if(!counter->check_streamed() || smr_counter_finish(counter) < 0)
+    return -1;
+  counter->matrix.print(outstream, delim);
+  return 0;
+}
+
+int smr_counter_set_checkpoint(SmrCounter *counter, const char *dirname)
+{
+  ReadTallyMatrix& matrix = counter->matrix;
+  const SmrConfig& config = matrix.config;
+  if(!matrix.empty())
+  {
+    matrix.error = "error: checkpoints must be set before adding samples";
+    return -1;
+  }
+  if(config.approx || config.sharedtable || config.perfecthash)
+  {
+    matrix.error = "error: checkpoints cannot be combined with approx, "
+                   "sharedtable or perfecthash";
+    return -1;
+  }
+  struct stat info;
+  if(mkdir(dirname, 0777) != 0 &&
+     (errno != EEXIST || stat(dirname, &info) != 0 || !S_ISDIR(info.st_mode)))
+  {
+    matrix.error = std::string("error creating checkpoint directory ") +
+                   dirname;
+    return -1;
+  }
+  matrix.checkpoint = dirname;
+  return 0;
+}
+
+int smr_counter_set_snapshot(SmrCounter *counter, const char *filename,
+                             char delim)
+{
+  ReadTallyMatrix& matrix = counter->matrix;
+  if(matrix.config.spill || matrix.config.transpose)
+  {
+    matrix.error = "error: snapshots cannot be combined with spill or "
+                   "transpose";
+    return -1;
+  }
+  matrix.snapshot = filename;
+  matrix.snapshotdelim = delim;
+  return 0;
+}
+
+void smr_counter_request_snapshot(SmrCounter *counter)
+{
+  __atomic_store_n(&counter->matrix.snapshotrequested, 1, __ATOMIC_RELAXED);
+}
+
+int smr_counter_set_ids(SmrCounter *counter, const char *filename)
+{
+  ReadTallyMatrix& matrix = counter->matrix;
+  if(matrix.ids || !matrix.empty())
+  {
+    matrix.error = "error: IDs must be set once, before adding samples";
+    return -1;
+  }
+  if(matrix.config.normalize != SMR_NORMALIZE_NONE)
+  {
+    matrix.error = "error: IDs cannot be combined with normalize";
+    return -1;
+  }
+  FILE *instream = fopen(filename, "r");
+  if(instream == NULL)
+  {
+    matrix.error = std::string("error opening ID file ") + filename;
+    return -1;
+  }
+
+  std::vector<char> ids;
+  char *line = NULL;
+  size_t capacity = 0;
+  while(getline(&line, &capacity, instream) > 0)
+  {
+    size_t len = strcspn(line, " \t\r\n");
+    if(len == 0)
+      continue;
+    ids.insert(ids.end(), line, line + len);
+    ids.push_back('\0');
+  }
+  free(line);
+  fclose(instream);
+  matrix.ids.reset(new IdAllowlist(ids));
+  if(matrix.output)
+    matrix.output->add_rows(*matrix.ids);
+  return 0;
+}
+
+int smr_counter_set_regions(SmrCounter *counter, const char *const *molids,
+                            unsigned n)
+{
+  ReadTallyMatrix& matrix = counter->matrix;
+  if(matrix.ids || !matrix.empty())
+  {
+    matrix.error = "error: regions must be set once, before adding samples, "
+                   "and cannot be combined with IDs";
+    return -1;
+  }
+  if(matrix.config.normalize != SMR_NORMALIZE_NONE)
+  {
+    matrix.error = "error: regions cannot be combined with normalize";
+    return -1;
+  }
+  std::vector<char> ids;
+  for(unsigned i = 0; i < n; i++)
+  {
+    if(molids[i][0] != '\0')
+      ids.insert(ids.end(), molids[i], molids[i] + strlen(molids[i]) + 1);
+  }
+  matrix.ids.reset(new IdAllowlist(ids));
+  matrix.regions = true;
+  if(matrix.output)
+    matrix.output->add_rows(*matrix.ids);
+  return 0;
+}
+
+int smr_counter_set_index(SmrCounter *counter, const char *filename)
+{
+  ReadTallyMatrix& matrix = counter->matrix;
+  if(matrix.reference || !matrix.empty())
+  {
+    matrix.error = "error: the index must be set once, before adding samples";
+    return -1;
+  }
+  if(matrix.config.approx || matrix.config.perfecthash)
+  {
+    matrix.error = "error: an index cannot be combined with approx or "
+                   "perfecthash";
+    return -1;
+  }
+  std::unique_ptr<ReferenceIndex> reference(new ReferenceIndex);
+  if(!reference->open(filename))
+  {
+    matrix.error = std::string("error opening index ") + filename;
+    return -1;
+  }
+  matrix.reference.swap(reference);
+  return 0;
+}
+
+int smr_index_build(const char *outfile, const char *const *infiles,
+                    unsigned numfiles)
+{
+  std::vector<char> ids;
+  std::vector<uint64_t> lengths;
+  CountTable seen;
+  char *line = NULL;
+  size_t capacity = 0;
+  for(unsigned i = 0; i < numfiles; i++)
+  {
+    FILE *instream = fopen(infiles[i], "r");
+    if(instream == NULL)
+    {
+      free(line);
+      return -1;
+    }
+    ssize_t len;
+    bool sam = false;
+    for(bool first = true; (len = getline(&line, &capacity, instream)) > 0;
+        first = false)
+    {
+      const char *eol = line + len;
+      const char *molid = line;
+      size_t idlen;
+      uint64_t length = 0;
+      if(first)
+        sam = line[0] == '@';
+      if(sam && line[0] != '@')
+        break;
+      if(sam)
+      {
+        size_t lnlen;
+        if(len < 4 || strncmp(line, "@SQ\t", 4) != 0 ||
+           (molid = ReadTally::sq_field(line, eol, "\tSN:", &idlen)) == NULL)
+          continue;
+        const char *ln = ReadTally::sq_field(line, eol, "\tLN:", &lnlen);
+        if(ln != NULL)
+          length = strtoull(ln, NULL, 10);
+      }
+      else
+      {
+        idlen = strcspn(line, " \t\r\n");
+        if(molid[idlen] == ' ' || molid[idlen] == '\t')
+          length = strtoull(molid + idlen + 1, NULL, 10);
+      }
+      uint64_t h = smr_hash(molid, idlen);
+      if(idlen == 0 || seen.find(molid, idlen, h) != 0)
+        continue;
+      seen.increment(molid, idlen, h);
+      ids.insert(ids.end(), molid, molid + idlen);
+      ids.push_back('\0');
+      lengths.push_back(length);
+    }
+    bool failed = ferror(instream);
+    fclose(instream);
+    if(failed)
+    {
+      free(line);
+      return -1;
+    }
+  }
+  free(line);
+  return ReferenceIndex::build(outfile, ids, lengths) ? 0 : -1;
+}
+
+FILE *smr_bgzf_open(const char *filename, unsigned numthreads)
+{
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if(fd < 0)
+    return NULL;
+  cookie_io_functions_t io = { NULL, smr_bgzf_write, NULL, smr_bgzf_close };
+  FILE *stream = fopencookie(new BgzfWriter(fd, numthreads), "w", io);
+  setvbuf(stream, NULL, _IOFBF, SMR_BGZF_BLOCK_SIZE);
+  return stream;
+}
+
+}
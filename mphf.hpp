@@ -0,0 +1,316 @@
+/*
+
+Copyright (c) 2013, Daniel S. Standage <daniel.standage@gmail.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#ifndef SMR_MPHF_HPP
+#define SMR_MPHF_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+#include "counttable.hpp"
+
+#define SMR_MPHF_GAMMA 2
+#define SMR_MPHF_MAX_LEVELS 24
+
+
+/**
+ * @type PerfectHash
+ *
+ * Minimal perfect hash function in the style of BBHash. Keys are given by their
+ * 64-bit hashes. At each level, every remaining key is mapped into a bit array
+ * of SMR_MPHF_GAMMA bits per key; keys that land on a bit of their own keep it,
+ * and colliding keys move on to the next level. The value of a key is the rank
+ * of its bit over all levels, so values are dense in [0, size()). Keys still
+ * colliding after SMR_MPHF_MAX_LEVELS levels (in practice, only keys with equal
+ * 64-bit hashes) are stored in a small fallback map.
+ */
+typedef struct PerfectHash PerfectHash;
+struct PerfectHash
+{
+  struct Level
+  {
+    uint64_t offset;  // bit offset of this level in the concatenated array
+    uint64_t size;    // number of bits in this level
+  };
+
+  // Each bit word is stored next to the number of set bits in all preceding
+  // words, so that evaluating the rank touches a single cache line.
+  struct Word
+  {
+    uint64_t bits;
+    uint64_t rank;
+  };
+
+  std::vector<Word> words;
+  std::vector<Level> levels;
+  std::unordered_map<uint64_t, uint64_t> fallback;
+  uint64_t numkeys;
+
+  PerfectHash() : numkeys(0) {}
+
+  PerfectHash(std::vector<uint64_t> keys) : numkeys(keys.size())
+  {
+    std::vector<uint64_t> collisions;
+    std::vector<uint64_t> next;
+    for(unsigned l = 0; l < SMR_MPHF_MAX_LEVELS && !keys.empty(); l++)
+    {
+      Level level;
+      level.offset = words.size() * 64;
+      level.size = (keys.size() * SMR_MPHF_GAMMA + 63) / 64 * 64;
+      levels.push_back(level);
+
+      size_t numwords = level.size / 64;
+      words.resize(words.size() + numwords, Word());
+      Word *levelwords = &words[level.offset / 64];
+      collisions.assign(numwords, 0);
+
+      for(auto key : keys)
+      {
+        uint64_t pos = position(key, l, level.size);
+        uint64_t mask = 1ULL << (pos & 63);
+        if(levelwords[pos / 64].bits & mask)
+          collisions[pos / 64] |= mask;
+        else
+          levelwords[pos / 64].bits |= mask;
+      }
+      for(size_t w = 0; w < numwords; w++)
+        levelwords[w].bits &= ~collisions[w];
+
+      next.clear();
+      for(auto key : keys)
+      {
+        uint64_t pos = position(key, l, level.size);
+        if(collisions[pos / 64] & (1ULL << (pos & 63)))
+          next.push_back(key);
+      }
+      keys.swap(next);
+    }
+
+    uint64_t rank = 0;
+    for(auto& word : words)
+    {
+      word.rank = rank;
+      rank += __builtin_popcountll(word.bits);
+    }
+    for(auto key : keys)
+    {
+      if(fallback.find(key) == fallback.end())
+        fallback.emplace(key, rank++);
+    }
+    numkeys = rank;
+  }
+
+  size_t size() const { return numkeys; }
+
+  static uint64_t position(uint64_t key, unsigned level, uint64_t size)
+  {
+    // splitmix64 finalizer over a per-level perturbation of the key hash,
+    // reduced to [0, size) with a multiply-shift instead of a modulus
+    uint64_t z = key + (level + 1) * 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z = z ^ (z >> 31);
+    return (uint64_t)(((unsigned __int128)z * size) >> 64);
+  }
+
+  void prefetch(uint64_t key, unsigned level = 0) const
+  {
+    if(level < levels.size())
+    {
+      uint64_t pos = levels[level].offset +
+                     position(key, level, levels[level].size);
+      __builtin_prefetch(&words[pos / 64]);
+    }
+  }
+
+  // Evaluate a single level: returns true and stores the value of the key if
+  // the key was placed at that level.
+  bool probe(uint64_t key, unsigned level, uint64_t *value) const
+  {
+    uint64_t pos = levels[level].offset + position(key, level,
+                                                   levels[level].size);
+    const Word& word = words[pos / 64];
+    uint64_t mask = 1ULL << (pos & 63);
+    if(word.bits & mask)
+    {
+      *value = word.rank + __builtin_popcountll(word.bits & (mask - 1));
+      return true;
+    }
+    return false;
+  }
+
+  // Returns the value of the key, or size() if the key is certainly not in
+  // the set. Keys outside of the set may also map to any value in range, so
+  // callers must verify the result. Evaluation may start at a later level if
+  // the earlier ones are already known to miss.
+  uint64_t lookup(uint64_t key, unsigned level = 0) const
+  {
+    uint64_t value;
+    for(unsigned l = level; l < levels.size(); l++)
+    {
+      if(probe(key, l, &value))
+        return value;
+    }
+    auto entry = fallback.find(key);
+    if(entry == fallback.end())
+      return numkeys;
+    return entry->second;
+  }
+};
+
+
+/**
+ * @type HeaderIndex
+ *
+ * The molecule IDs declared in the @SQ lines of a SAM header, laid out densely
+ * by their perfect hash value, each with a read count. A lookup costs one
+ * string hash, one perfect hash evaluation, and one memcmp against the stored
+ * ID to verify the match. Each entry is half a cache line and keeps the first
+ * SMR_INLINE_ID_LENGTH bytes of its ID, so that verifying short IDs touches
+ * nothing but the entry itself.
+ */
+#define SMR_INLINE_ID_LENGTH 16
+typedef struct HeaderIndex HeaderIndex;
+struct HeaderIndex
+{
+  struct Entry
+  {
+    uint64_t offset : 48;
+    uint64_t length : 16;
+    uint64_t count;
+    char prefix[SMR_INLINE_ID_LENGTH];
+  };
+
+  std::vector<char> names;
+  std::vector<Entry> entries;  // indexed by perfect hash value
+  PerfectHash mphf;
+
+  // Build the index from the molecule IDs stored (NUL-terminated) in `ids`.
+  // Duplicate IDs are kept only once, and IDs too long for an entry are left
+  // out of the index.
+  HeaderIndex(const std::vector<char>& ids) : names(ids)
+  {
+    std::vector<uint64_t> hashes;
+    std::vector<uint64_t> offsets;
+    for(size_t i = 0; i < names.size(); i += strlen(&names[i]) + 1)
+    {
+      size_t len = strlen(&names[i]);
+      if(len > 0 && len < (1 << 16))
+      {
+        hashes.push_back(smr_hash(&names[i], len));
+        offsets.push_back(i);
+      }
+    }
+
+    mphf = PerfectHash(hashes);
+    entries.assign(mphf.size(), Entry());
+    for(size_t i = 0; i < offsets.size(); i++)
+    {
+      Entry& entry = entries[mphf.lookup(hashes[i])];
+      if(entry.length == 0)
+      {
+        const char *name = &names[offsets[i]];
+        entry.offset = offsets[i];
+        entry.length = strlen(name);
+        memcpy(entry.prefix, name, std::min<size_t>(entry.length,
+                                                    SMR_INLINE_ID_LENGTH));
+      }
+    }
+  }
+
+  size_t size() const { return entries.size(); }
+
+  const char *name(uint64_t value) const
+  {
+    return &names[entries[value].offset];
+  }
+
+  void prefetch(uint64_t value) const
+  {
+    if(value < size())
+      __builtin_prefetch(&entries[value], 1);
+  }
+
+  // Check that the perfect hash value of a key really belongs to that key
+  bool verify(uint64_t value, const char *key, size_t len) const
+  {
+    if(value >= size() || entries[value].length != len)
+      return false;
+    if(len <= SMR_INLINE_ID_LENGTH)
+      return memcmp(entries[value].prefix, key, len) == 0;
+    return memcmp(&names[entries[value].offset], key, len) == 0;
+  }
+
+  // Returns the dense index of the molecule, or size() if it is not declared
+  // in the header.
+  uint64_t find(const char *key, size_t len, uint64_t h) const
+  {
+    uint64_t value = mphf.lookup(h);
+    return verify(value, key, len) ? value : size();
+  }
+
+  // Count a batch of reads, pipelined in passes: hash the IDs and prefetch
+  // their first-level perfect hash words; probe the first level, prefetching
+  // the entry on a hit or the second-level word on a miss; finish evaluating
+  // the perfect hash for the misses; then verify and increment. Reads mapped
+  // to IDs that are not in the index are passed to `table`. The batch may hold
+  // at most SMR_MAX_BATCH keys. When the index is `shared` by several threads,
+  // counts are incremented with relaxed atomic adds.
+  void increment_batch(const CountTable::Key *batch, size_t n,
+                       CountTable& table, bool shared = false)
+  {
+    uint64_t hashes[SMR_MAX_BATCH];
+    uint64_t values[SMR_MAX_BATCH];
+    for(size_t i = 0; i < n; i++)
+    {
+      hashes[i] = smr_hash(batch[i].str, batch[i].len);
+      mphf.prefetch(hashes[i]);
+    }
+    for(size_t i = 0; i < n; i++)
+    {
+      if(mphf.levels.empty() || !mphf.probe(hashes[i], 0, &values[i]))
+      {
+        values[i] = size();
+        mphf.prefetch(hashes[i], 1);
+      }
+      else
+        prefetch(values[i]);
+    }
+    for(size_t i = 0; i < n; i++)
+    {
+      if(values[i] == size())
+      {
+        values[i] = mphf.lookup(hashes[i], 1);
+        prefetch(values[i]);
+      }
+    }
+    for(size_t i = 0; i < n; i++)
+    {
+      if(!verify(values[i], batch[i].str, batch[i].len))
+        table.increment(batch[i].str, batch[i].len, hashes[i]);
+      else if(shared)
+        __atomic_fetch_add(&entries[values[i]].count, 1, __ATOMIC_RELAXED);
+      else
+        entries[values[i]].count++;
+    }
+  }
+};
+
+#endif
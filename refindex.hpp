@@ -0,0 +1,289 @@
+/*
+
+Copyright (c) 2013, Daniel S. Standage <daniel.standage@gmail.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#ifndef SMR_REFINDEX_HPP
+#define SMR_REFINDEX_HPP
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "counttable.hpp"
+
+#define SMR_INDEX_MAGIC "SMRINDX1"
+
+
+/**
+ * @type ReferenceIndex
+ *
+ * A dictionary of molecule IDs compiled once by `smr index`, then mapped
+ * read-only by every run that counts against it, so that no table is built at
+ * startup and concurrent processes share its pages through the page cache.
+ *
+ * The file holds a Header, then one Row per ID (its hash, the offset and
+ * length of its name, and the molecule's length, or 0 if unknown), then an
+ * open-addressing slot array of row numbers plus 1 (at most half full, probed
+ * linearly from the hash, 0 for an empty slot), and then the NUL-terminated
+ * names. Rows are numbered in the order the IDs were listed, so reads can be
+ * counted in a dense array indexed by row.
+ *
+ * Dense arrays (see Counts) are allocated once and recycled by acquire() and
+ * release(), and only the rows a worker touched are folded and cleared, so a
+ * task costs nothing in the size of the index however small it is.
+ */
+typedef struct ReferenceIndex ReferenceIndex;
+struct ReferenceIndex
+{
+  struct Header
+  {
+    char magic[8];
+    uint64_t numids;
+    uint64_t numslots;
+    uint64_t namebytes;
+  };
+
+  struct Row
+  {
+    uint64_t hash;
+    uint64_t nameoff : 40;
+    uint64_t namelen : 24;
+    uint64_t length;
+  };
+
+  // A dense array of counts indexed by row, and the rows whose count is
+  // nonzero, in the order they were first counted
+  struct Counts
+  {
+    std::vector<uint64_t> counts;
+    std::vector<uint32_t> touched;
+  };
+
+  void *map;
+  size_t mapsize;
+  const Row *rows;
+  const uint32_t *slots;
+  const char *names;
+  size_t numids;
+  size_t mask;
+  mutable std::mutex lock;  // guards spare
+  mutable std::vector<std::unique_ptr<Counts> > spare;
+
+  ReferenceIndex()
+    : map(MAP_FAILED), mapsize(0), rows(NULL), slots(NULL), names(NULL),
+      numids(0), mask(0) {}
+
+  ~ReferenceIndex()
+  {
+    if(map != MAP_FAILED)
+      munmap(map, mapsize);
+  }
+
+  // Map the index at `path`; returns false if it cannot be read or is not an
+  // index
+  bool open(const char *path)
+  {
+    int fd = ::open(path, O_RDONLY);
+    if(fd < 0)
+      return false;
+    struct stat info;
+    if(fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(Header))
+    {
+      close(fd);
+      return false;
+    }
+    mapsize = info.st_size;
+    map = mmap(NULL, mapsize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+      return false;
+
+    const Header *header = (const Header *)map;
+    numids = header->numids;
+    mask = header->numslots - 1;
+    rows = (const Row *)(header + 1);
+    slots = (const uint32_t *)(rows + numids);
+    names = (const char *)(slots + header->numslots);
+    if(memcmp(header->magic, SMR_INDEX_MAGIC, 8) != 0 ||
+       numids > mapsize / sizeof(Row) ||
+       header->numslots > mapsize / sizeof(uint32_t) ||
+       header->namebytes > mapsize || header->numslots <= numids ||
+       (header->numslots & mask) != 0 ||
+       mapsize != sizeof(Header) + numids * sizeof(Row) +
+                  header->numslots * sizeof(uint32_t) + header->namebytes)
+      return false;
+
+    // Every name must lie within the name bytes, NUL-terminated, and every
+    // slot must point to a row, or lookups could read past the mapping
+    for(size_t r = 0; r < numids; r++)
+    {
+      uint64_t end = rows[r].nameoff + rows[r].namelen;
+      if(end >= header->namebytes || names[end] != '\0')
+        return false;
+    }
+    for(size_t i = 0; i <= mask; i++)
+    {
+      if(slots[i] > numids)
+        return false;
+    }
+    return true;
+  }
+
+  // Write an index of the NUL-terminated IDs in `ids` and their lengths to
+  // `path`, under a temporary name that is renamed when complete; returns
+  // false, with errno set, if it cannot be written. IDs must be unique.
+  static bool build(const char *path, const std::vector<char>& ids,
+                    const std::vector<uint64_t>& lengths)
+  {
+    std::vector<Row> rows;
+    for(size_t i = 0; i < ids.size(); i += strlen(&ids[i]) + 1)
+    {
+      Row row;
+      row.namelen = strlen(&ids[i]);
+      row.nameoff = i;
+      row.hash = smr_hash(&ids[i], row.namelen);
+      row.length = lengths[rows.size()];
+      rows.push_back(row);
+    }
+    size_t numslots = 16;
+    while(numslots < 2 * rows.size())
+      numslots <<= 1;
+    std::vector<uint32_t> slots(numslots, 0);
+    for(size_t r = 0; r < rows.size(); r++)
+    {
+      size_t i = rows[r].hash & (numslots - 1);
+      while(slots[i] != 0)
+        i = (i + 1) & (numslots - 1);
+      slots[i] = r + 1;
+    }
+
+    Header header;
+    memcpy(header.magic, SMR_INDEX_MAGIC, 8);
+    header.numids = rows.size();
+    header.numslots = numslots;
+    header.namebytes = ids.size();
+    std::string temp = std::string(path) + ".tmp";
+    FILE *out = fopen(temp.c_str(), "wb");
+    if(out == NULL)
+      return false;
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(rows.data(), sizeof(Row), rows.size(), out);
+    fwrite(slots.data(), sizeof(uint32_t), slots.size(), out);
+    fwrite(ids.data(), 1, ids.size(), out);
+    if(ferror(out))
+    {
+      fclose(out);
+      return false;
+    }
+    return fclose(out) == 0 && rename(temp.c_str(), path) == 0;
+  }
+
+  size_t size() const { return numids; }
+  const char *name(size_t r) const { return names + rows[r].nameoff; }
+
+  // Returns the row of the molecule, or size() if it is not in the index
+  size_t find(const char *key, size_t len, uint64_t h) const
+  {
+    for(size_t i = h & mask; slots[i] != 0; i = (i + 1) & mask)
+    {
+      const Row& row = rows[slots[i] - 1];
+      if(row.hash == h && row.namelen == len &&
+         memcmp(names + row.nameoff, key, len) == 0)
+        return slots[i] - 1;
+    }
+    return size();
+  }
+
+  // Length of the molecule, or 0 if it is unknown
+  uint64_t length(const char *key, size_t len) const
+  {
+    size_t r = find(key, len, smr_hash(key, len));
+    return r < size() ? rows[r].length : 0;
+  }
+
+  // Hand out a dense array of zero counts, reusing a released one if any
+  Counts *acquire() const
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if(spare.empty())
+    {
+      Counts *dense = new Counts;
+      dense->counts.assign(size(), 0);
+      return dense;
+    }
+    Counts *dense = spare.back().release();
+    spare.pop_back();
+    return dense;
+  }
+
+  // Take back an array from acquire(), which must have been folded
+  void release(Counts *dense) const
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    spare.emplace_back(dense);
+  }
+
+  // Count a batch of reads in `dense`, pipelined in passes: hash the IDs and
+  // prefetch their slots, then prefetch the rows the slots point to, then
+  // verify and increment. Reads mapped to IDs missing from the index are
+  // passed to `table`. The batch may hold at most SMR_MAX_BATCH keys.
+  void increment_batch(const CountTable::Key *batch, size_t n,
+                       Counts& dense, CountTable& table) const
+  {
+    uint64_t hashes[SMR_MAX_BATCH];
+    for(size_t i = 0; i < n; i++)
+    {
+      hashes[i] = smr_hash(batch[i].str, batch[i].len);
+      __builtin_prefetch(&slots[hashes[i] & mask]);
+    }
+    for(size_t i = 0; i < n; i++)
+    {
+      uint32_t slot = slots[hashes[i] & mask];
+      if(slot != 0)
+        __builtin_prefetch(&rows[slot - 1]);
+    }
+    for(size_t i = 0; i < n; i++)
+    {
+      size_t r = find(batch[i].str, batch[i].len, hashes[i]);
+      if(r >= size())
+        table.increment(batch[i].str, batch[i].len, hashes[i]);
+      else if(dense.counts[r]++ == 0)
+        dense.touched.push_back(r);
+    }
+  }
+
+  // Add the counts of the rows touched in `dense` to `table`, and clear them
+  void fold(Counts& dense, CountTable& table) const
+  {
+    for(uint32_t r : dense.touched)
+    {
+      table.increment(name(r), rows[r].namelen, rows[r].hash,
+                      dense.counts[r]);
+      dense.counts[r] = 0;
+    }
+    dense.touched.clear();
+  }
+};
+
+#endif
@@ -0,0 +1,119 @@
+/*
+
+Copyright (c) 2013, Daniel S. Standage <daniel.standage@gmail.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#ifndef SMR_SAMLINE_HPP
+#define SMR_SAMLINE_HPP
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+
+/**
+ * Locate the RNAME field of the SAM line [line, eol). Returns false for header
+ * lines, unmapped reads (FLAG bit 0x4), and lines with fewer than 3 fields.
+ */
+static inline bool smr_parse_alignment(const char *line, const char *eol,
+                                       const char **molid, size_t *len)
+{
+  if(line == eol || line[0] == '@')
+    return false;
+
+  const char *flag = (const char *)memchr(line, '\t', eol - line);
+  if(flag == NULL)
+    return false;
+  flag++;
+  int bflag = 0;
+  const char *c = flag;
+  for(; c < eol && *c >= '0' && *c <= '9'; c++)
+    bflag = bflag * 10 + (*c - '0');
+  if(bflag & 0x4)
+    return false;
+
+  const char *rname = (const char *)memchr(c, '\t', eol - c);
+  if(rname == NULL)
+    return false;
+  rname++;
+  const char *rnameend = (const char *)memchr(rname, '\t', eol - rname);
+  *molid = rname;
+  *len = (rnameend == NULL ? eol : rnameend) - rname;
+  return true;
+}
+
+
+/**
+ * @type SamSplitLine
+ *
+ * A SAM line cut by the end of a buffer and carried over to the next ones.
+ * Only what counting needs is copied: the QNAME, FLAG and RNAME fields of an
+ * alignment, or all of a header line. Once the tab after RNAME is seen, the
+ * rest of the alignment is skipped up to its newline, however many buffers it
+ * spans, so memory stays bounded by those three fields no matter how long the
+ * SEQ and QUAL of a long read are.
+ */
+typedef struct SamSplitLine SamSplitLine;
+struct SamSplitLine
+{
+  std::string head;
+  unsigned tabs;  // tabs kept in `head`
+  bool open;      // a line is being carried
+
+  SamSplitLine() : tabs(0), open(false) {}
+
+  bool empty() const { return !open; }
+  const char *begin() const { return head.data(); }
+  const char *end() const { return head.data() + head.size(); }
+
+  // Carry the line that starts at [p, stop) and continues past `stop`
+  void start(const char *p, const char *stop)
+  {
+    head.clear();
+    tabs = 0;
+    open = true;
+    append(p, stop);
+  }
+
+  // Continue the line with [p, stop), which holds no newline
+  void append(const char *p, const char *stop)
+  {
+    if(p == stop)
+      return;
+    if((head.empty() ? *p : head[0]) == '@')
+    {
+      head.append(p, stop);
+      return;
+    }
+    while(p < stop && tabs < 3)
+    {
+      const char *tab = (const char *)memchr(p, '\t', stop - p);
+      if(tab == NULL)
+      {
+        head.append(p, stop);
+        return;
+      }
+      head.append(p, tab + 1);
+      tabs++;
+      p = tab + 1;
+    }
+  }
+
+  // End the line; what was kept stays valid until the next start()
+  void close() { open = false; }
+};
+
+#endif
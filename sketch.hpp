@@ -0,0 +1,176 @@
+/*
+
+Copyright (c) 2013, Daniel S. Standage <daniel.standage@gmail.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#ifndef SMR_SKETCH_HPP
+#define SMR_SKETCH_HPP
+
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "counttable.hpp"
+
+#define SMR_SKETCH_DEPTH 4
+
+
+// splitmix64 finalizer, used to derive independent hash values from one
+// 64-bit molecule ID or read name hash
+static inline uint64_t smr_mix(uint64_t z)
+{
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+
+/**
+ * @type CountMinSketch
+ *
+ * Count-min sketch with SMR_SKETCH_DEPTH rows of `width` counters. Memory is
+ * fixed at construction, no matter how many molecules are counted. An
+ * estimate never undercounts, and it overcounts by at most e/width times the
+ * total number of reads counted, with probability 1 - exp(-depth). When the
+ * sketch is shared by several threads, counters are incremented with relaxed
+ * atomic adds.
+ */
+typedef struct CountMinSketch CountMinSketch;
+struct CountMinSketch
+{
+  size_t width;
+  size_t mask;
+  std::vector<uint32_t> counters;
+  uint64_t total;
+
+  CountMinSketch(size_t minwidth) : total(0)
+  {
+    width = 1024;
+    while(width < minwidth)
+      width <<= 1;
+    mask = width - 1;
+    counters.assign(width * SMR_SKETCH_DEPTH, 0);
+  }
+
+  size_t cell(uint64_t h, unsigned row) const
+  {
+    return row * width + (smr_mix(h + (row + 1) * 0x9e3779b97f4a7c15ULL) &
+                          mask);
+  }
+
+  uint32_t estimate(uint64_t h) const
+  {
+    uint32_t min = counters[cell(h, 0)];
+    for(unsigned row = 1; row < SMR_SKETCH_DEPTH; row++)
+      min = std::min(min, counters[cell(h, row)]);
+    return min;
+  }
+
+  uint32_t estimate(const char *key, size_t len) const
+  {
+    return estimate(smr_hash(key, len));
+  }
+
+  // Largest overcount of any estimate, with probability 1 - failure()
+  double error_bound() const { return M_E / width * total; }
+  static double failure() { return exp(-SMR_SKETCH_DEPTH); }
+
+  // Count a batch of at most SMR_MAX_BATCH keys: hash them and prefetch all of
+  // their counters, then increment. The new estimate of each key is stored in
+  // `estimates`, and its hash in `hashes`.
+  void increment_batch(const CountTable::Key *batch, size_t n, bool shared,
+                       uint64_t *hashes, uint32_t *estimates)
+  {
+    for(size_t i = 0; i < n; i++)
+    {
+      hashes[i] = smr_hash(batch[i].str, batch[i].len);
+      for(unsigned row = 0; row < SMR_SKETCH_DEPTH; row++)
+        __builtin_prefetch(&counters[cell(hashes[i], row)], 1);
+    }
+    for(size_t i = 0; i < n; i++)
+    {
+      uint32_t min = UINT32_MAX;
+      for(unsigned row = 0; row < SMR_SKETCH_DEPTH; row++)
+      {
+        uint32_t *counter = &counters[cell(hashes[i], row)];
+        uint32_t value = shared ? __atomic_add_fetch(counter, 1,
+                                                     __ATOMIC_RELAXED) :
+                                  ++*counter;
+        min = std::min(min, value);
+      }
+      estimates[i] = min;
+    }
+    if(shared)
+      __atomic_fetch_add(&total, n, __ATOMIC_RELAXED);
+    else
+      total += n;
+  }
+};
+
+
+/**
+ * @type HeavyHitters
+ *
+ * The (at most) `capacity` molecule IDs with the largest estimated counts seen
+ * so far, keyed by ID hash so that checking a read costs no allocation. An ID
+ * is only looked up once its estimate exceeds the smallest estimate in the
+ * list, and evicting that smallest entry scans the list.
+ */
+typedef struct HeavyHitters HeavyHitters;
+struct HeavyHitters
+{
+  struct Entry
+  {
+    std::string molid;
+    uint32_t estimate;
+  };
+
+  size_t capacity;
+  std::unordered_map<uint64_t, Entry> entries;
+  uint32_t minimum;  // no entry has a smaller estimate
+
+  HeavyHitters(size_t capacity) : capacity(capacity), minimum(0) {}
+
+  void offer(const char *key, size_t len, uint64_t h, uint32_t estimate)
+  {
+    if(entries.size() >= capacity && estimate <= minimum)
+      return;
+
+    auto entry = entries.find(h);
+    if(entry != entries.end())
+    {
+      entry->second.estimate = std::max(entry->second.estimate, estimate);
+      return;
+    }
+    if(entries.size() >= capacity)
+    {
+      auto smallest = entries.begin();
+      for(auto it = entries.begin(); it != entries.end(); ++it)
+      {
+        if(it->second.estimate < smallest->second.estimate)
+          smallest = it;
+      }
+      minimum = smallest->second.estimate;
+      if(estimate <= minimum)
+        return;
+      entries.erase(smallest);
+    }
+    entries.emplace(h, Entry{std::string(key, len), estimate});
+  }
+};
+
+#endif
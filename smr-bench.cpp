@@ -0,0 +1,556 @@
+/*
+
+Copyright (c) 2013, Daniel S. Standage <daniel.standage@gmail.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+
+SMR benchmarks
+
+Synthetic benchmarks for the read counting data structures. Each benchmark
+builds an in-memory stream of molecule IDs, or of SAM lines, so that timings
+reflect only the counting work and not file I/O.
+
+Usage: smr-bench [NUMREADS [SECTION...]], where the sections are 'tables',
+'mphf', 'threads', 'rows' and 'parser'; all of them are run by default.
+
+*/
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "concurrenttable.hpp"
+#include "countcolumn.hpp"
+#include "counttable.hpp"
+#include "mphf.hpp"
+#include "samline.hpp"
+
+
+/**
+ * @type KeyStream
+ *
+ * A set of `numids` distinct molecule IDs and a stream of `numreads` keys drawn
+ * uniformly at random from that set. The keys of the stream are copied into a
+ * contiguous buffer, as they would be when read sequentially from a file.
+ */
+typedef struct KeyStream KeyStream;
+struct KeyStream
+{
+  std::vector<char> ids;
+  std::vector<char> buffer;
+  std::vector<CountTable::Key> reads;
+
+  KeyStream(size_t numids, size_t numreads)
+  {
+    std::vector<size_t> offsets;
+    char id[64];
+    for(size_t i = 0; i < numids; i++)
+    {
+      int len = snprintf(id, sizeof(id), "molecule_%zu", i);
+      offsets.push_back(ids.size());
+      ids.insert(ids.end(), id, id + len + 1);
+    }
+
+    std::mt19937_64 rng(numids);
+    std::uniform_int_distribution<size_t> pick(0, numids - 1);
+    std::vector<size_t> lengths;
+    for(size_t i = 0; i < numreads; i++)
+    {
+      const char *str = &ids[offsets[pick(rng)]];
+      lengths.push_back(strlen(str));
+      buffer.insert(buffer.end(), str, str + lengths.back() + 1);
+    }
+    const char *str = &buffer[0];
+    for(auto len : lengths)
+    {
+      reads.push_back({str, len});
+      str += len + 1;
+    }
+  }
+};
+
+
+/**
+ * @type SamBuffer
+ *
+ * `numrecords` SAM lines with reads of `readlength` bases, mapped uniformly at
+ * random to `numids` molecules, with about 1 read in 20 unmapped; laid out in
+ * one buffer, as a block read from a file would be.
+ */
+typedef struct SamBuffer SamBuffer;
+struct SamBuffer
+{
+  std::vector<char> text;
+  size_t numrecords;
+
+  SamBuffer(size_t numids, size_t numrecords, size_t readlength)
+    : numrecords(numrecords)
+  {
+    std::mt19937_64 rng(numids + readlength);
+    std::uniform_int_distribution<size_t> pick(0, numids - 1);
+    std::string seq(readlength, 'A'), qual(readlength, 'I');
+    const char bases[] = "ACGT";
+    for(size_t i = 0; i < readlength; i++)
+      seq[i] = bases[rng() & 3];
+
+    char fields[256];
+    for(size_t i = 0; i < numrecords; i++)
+    {
+      bool unmapped = rng() % 20 == 0;
+      int len;
+      if(unmapped)
+        len = snprintf(fields, sizeof(fields), "read_%zu\t4\t*\t0\t0\t*\t*\t0\t0"
+                       "\t", i);
+      else
+        len = snprintf(fields, sizeof(fields), "read_%zu\t%d\tmolecule_%zu\t"
+                       "%zu\t60\t%zuM\t*\t0\t0\t", i, (int)(rng() & 16),
+                       pick(rng), (size_t)(rng() % 100000) + 1, readlength);
+      text.insert(text.end(), fields, fields + len);
+      text.insert(text.end(), seq.begin(), seq.end());
+      text.push_back('\t');
+      text.insert(text.end(), qual.begin(), qual.end());
+      text.push_back('\n');
+    }
+  }
+};
+
+
+/**
+ * @type PerfCounters
+ *
+ * Hardware counters for this thread, read with perf_event_open(2): cycles,
+ * instructions, branch misses and last-level cache read misses. Each counter
+ * is opened on its own, so that one the system does not support (or forbids,
+ * see /proc/sys/kernel/perf_event_paranoid) is simply reported as missing.
+ */
+typedef struct PerfCounters PerfCounters;
+struct PerfCounters
+{
+  enum { CYCLES, INSTRUCTIONS, BRANCH_MISSES, LLC_MISSES, NUM_COUNTERS };
+
+  int fds[NUM_COUNTERS];
+  uint64_t values[NUM_COUNTERS];
+
+  PerfCounters()
+  {
+    const uint32_t types[NUM_COUNTERS] = {
+      PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+      PERF_TYPE_HW_CACHE
+    };
+    const uint64_t configs[NUM_COUNTERS] = {
+      PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+      PERF_COUNT_HW_BRANCH_MISSES,
+      PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+    };
+    for(int i = 0; i < NUM_COUNTERS; i++)
+    {
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = types[i];
+      attr.config = configs[i];
+      attr.disabled = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+      values[i] = 0;
+    }
+  }
+
+  ~PerfCounters()
+  {
+    for(int i = 0; i < NUM_COUNTERS; i++)
+    {
+      if(fds[i] >= 0)
+        close(fds[i]);
+    }
+  }
+
+  bool available() const
+  {
+    for(int i = 0; i < NUM_COUNTERS; i++)
+    {
+      if(fds[i] >= 0)
+        return true;
+    }
+    return false;
+  }
+
+  void start()
+  {
+    for(int i = 0; i < NUM_COUNTERS; i++)
+    {
+      if(fds[i] < 0)
+        continue;
+      ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+
+  void stop()
+  {
+    for(int i = 0; i < NUM_COUNTERS; i++)
+    {
+      if(fds[i] < 0)
+        continue;
+      ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+      if(read(fds[i], &values[i], sizeof(values[i])) != sizeof(values[i]))
+        values[i] = 0;
+    }
+  }
+
+  // Print counter `i` per record, or n/a if it could not be opened
+  void print(int i, size_t numrecords) const
+  {
+    if(fds[i] < 0)
+      printf("%12s", "n/a");
+    else
+      printf("%12.1f", (double)values[i] / numrecords);
+  }
+};
+
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// Time `numreads` increments with the given batch size; the table is already
+// populated with every ID so that only the lookup cost is measured.
+static double bench_batch(KeyStream& stream, size_t batchsize)
+{
+  CountTable table;
+  const std::vector<CountTable::Key>& reads = stream.reads;
+  for(auto& key : reads)
+    table.increment(key.str, key.len);
+
+  auto start = std::chrono::steady_clock::now();
+  for(size_t i = 0; i < reads.size(); i += batchsize)
+  {
+    size_t n = reads.size() - i < batchsize ? reads.size() - i : batchsize;
+    table.increment_batch(&reads[i], n);
+  }
+  return seconds_since(start);
+}
+
+static void bench_table_sizes(size_t numreads)
+{
+  const size_t numids[] = { 1000, 10000, 100000, 1000000, 4000000 };
+  const size_t batchsizes[] = { 1, 4, 16, 32, 64 };
+
+  printf("\nBatched, prefetched count table increments (ns per read)\n");
+  printf("%10s", "molecules");
+  for(auto batchsize : batchsizes)
+    printf("%10s%-3zu", "batch=", batchsize);
+  printf("\n");
+
+  for(auto n : numids)
+  {
+    KeyStream stream(n, numreads);
+    printf("%10zu", n);
+    for(auto batchsize : batchsizes)
+    {
+      double elapsed = bench_batch(stream, batchsize);
+      printf("%13.1f", elapsed * 1e9 / numreads);
+    }
+    printf("\n");
+  }
+}
+
+// Build a header index over every ID in the stream, then count the reads into
+// it in batches of 32; returns the build and counting times separately.
+static void bench_perfect_hash(KeyStream& stream, double *buildtime,
+                               double *counttime)
+{
+  auto start = std::chrono::steady_clock::now();
+  HeaderIndex index(stream.ids);
+  *buildtime = seconds_since(start);
+
+  CountTable misses;
+  const std::vector<CountTable::Key>& reads = stream.reads;
+  start = std::chrono::steady_clock::now();
+  for(size_t i = 0; i < reads.size(); i += 32)
+  {
+    size_t n = reads.size() - i < 32 ? reads.size() - i : 32;
+    index.increment_batch(&reads[i], n, misses);
+  }
+  *counttime = seconds_since(start);
+}
+
+static void bench_header_index(size_t numreads)
+{
+  const size_t numids[] = { 1000, 100000, 1000000, 10000000 };
+
+  printf("\nMinimal perfect hash header index vs count table (batch=32)\n");
+  printf("%10s%14s%18s%18s\n", "molecules", "build (s)", "mphf (ns/read)",
+         "table (ns/read)");
+  for(auto n : numids)
+  {
+    KeyStream stream(n, numreads);
+    double buildtime, counttime;
+    bench_perfect_hash(stream, &buildtime, &counttime);
+    double tabletime = bench_batch(stream, 32);
+    printf("%10zu%14.3f%18.1f%18.1f\n", n, buildtime,
+           counttime * 1e9 / numreads, tabletime * 1e9 / numreads);
+  }
+}
+
+// Count the stream on `numthreads` threads, either each into a table of its
+// own followed by a merge, or all into one shared table. Returns the elapsed
+// time, and the memory used by the tables in `bytes`.
+static double bench_threads(KeyStream& stream, size_t numids,
+                            unsigned numthreads, bool sharedtable,
+                            size_t *bytes)
+{
+  const std::vector<CountTable::Key>& reads = stream.reads;
+  size_t slice = (reads.size() + numthreads - 1) / numthreads;
+  std::vector<CountTable> locals(numthreads);
+  ConcurrentCountTable shared(sharedtable ? numids : 0);
+  CountTable result;
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for(unsigned t = 0; t < numthreads; t++)
+  {
+    threads.emplace_back([&, t]() {
+      ConcurrentCountTable::Arena arena(&shared);
+      size_t end = std::min(reads.size(), (t + 1) * slice);
+      for(size_t i = t * slice; i < end; i += 32)
+      {
+        size_t n = std::min<size_t>(32, end - i);
+        if(sharedtable)
+          shared.increment_batch(&reads[i], n, arena, locals[t]);
+        else
+          locals[t].increment_batch(&reads[i], n);
+      }
+    });
+  }
+  for(auto& thread : threads)
+    thread.join();
+  for(auto& local : locals)
+    result.merge(local);
+  if(sharedtable)
+    shared.merge_into(result);
+  double elapsed = seconds_since(start);
+
+  *bytes = 0;
+  for(auto& local : locals)
+    *bytes += local.slots.size() * sizeof(CountTable::Slot) +
+              local.keys.capacity();
+  if(sharedtable)
+    *bytes += shared.capacity * sizeof(ConcurrentCountTable::Slot) +
+              shared.blocks.size() * SMR_ARENA_BLOCK_SIZE;
+  return elapsed;
+}
+
+static void bench_thread_counts(size_t numreads)
+{
+  const size_t numids[] = { 10000, 1000000, 4000000 };
+  const unsigned numthreads[] = { 1, 2, 4, 8 };
+
+  printf("\nThread-local tables + merge vs shared lock-free table\n");
+  printf("%10s%9s%18s%12s%18s%13s\n", "molecules", "threads",
+         "local (ns/read)", "local (MB)", "shared (ns/read)", "shared (MB)");
+  for(auto n : numids)
+  {
+    KeyStream stream(n, numreads);
+    for(auto t : numthreads)
+    {
+      size_t localbytes, sharedbytes;
+      double localtime = bench_threads(stream, n, t, false, &localbytes);
+      double sharedtime = bench_threads(stream, n, t, true, &sharedbytes);
+      printf("%10zu%9u%18.1f%12.1f%18.1f%13.1f\n", n, t,
+             localtime * 1e9 / numreads, localbytes / 1048576.0,
+             sharedtime * 1e9 / numreads, sharedbytes / 1048576.0);
+    }
+  }
+}
+
+// Number the keys of `table` in a row dictionary, walking the table in slot
+// order as a finished sample is stored; returns the elapsed time.
+static double bench_rows(const CountTable& table, bool reserve)
+{
+  RowDictionary dictionary;
+  auto start = std::chrono::steady_clock::now();
+  if(reserve)
+    dictionary.reserve(table.size());
+  for(auto kvpair : table)
+    dictionary.row(kvpair.first, strlen(kvpair.first));
+  return seconds_since(start);
+}
+
+static void bench_row_numbering()
+{
+  const size_t numids[] = { 100000, 1000000, 3000000 };
+
+  printf("\nNumbering the molecules of a table in slot order (ns per ID)\n");
+  printf("%10s%14s%14s%16s\n", "molecules", "count", "reserved",
+         "unreserved");
+  for(auto n : numids)
+  {
+    KeyStream stream(n, 0);
+    CountTable table;
+    auto start = std::chrono::steady_clock::now();
+    for(const char *id = stream.ids.data();
+        id < stream.ids.data() + stream.ids.size(); id += strlen(id) + 1)
+      table.increment(id, strlen(id));
+    double counttime = seconds_since(start);
+    double reserved = bench_rows(table, true);
+    double unreserved = bench_rows(table, false);
+    printf("%10zu%14.1f%14.1f%16.1f\n", n, counttime * 1e9 / n,
+           reserved * 1e9 / n, unreserved * 1e9 / n);
+  }
+}
+
+// The stages of the counting loop, each including the ones before it: split
+// the first `bytes` of the buffer into lines; find FLAG and RNAME; hash RNAME;
+// count it in a table in batches of 32. Each returns a checksum so that no
+// work is optimized away.
+enum { STAGE_SPLIT, STAGE_PARSE, STAGE_HASH, STAGE_COUNT, NUM_STAGES };
+static volatile uint64_t smr_bench_sink;
+
+static uint64_t run_stage(const SamBuffer& sam, size_t bytes, int stage,
+                          CountTable& table)
+{
+  uint64_t checksum = 0;
+  CountTable::Key batch[32];
+  size_t n = 0;
+  const char *p = sam.text.data();
+  const char *stop = p + bytes;
+  const char *eol;
+  while(p < stop && (eol = (const char *)memchr(p, '\n', stop - p)))
+  {
+    const char *molid;
+    size_t len;
+    if(stage == STAGE_SPLIT)
+      checksum += eol - p;
+    else if(smr_parse_alignment(p, eol, &molid, &len))
+    {
+      if(stage == STAGE_PARSE)
+        checksum += len;
+      else if(stage == STAGE_HASH)
+        checksum ^= smr_hash(molid, len);
+      else
+      {
+        batch[n].str = molid;
+        batch[n].len = len;
+        if(++n == 32)
+        {
+          table.increment_batch(batch, n);
+          n = 0;
+        }
+      }
+    }
+    p = eol + 1;
+  }
+  table.increment_batch(batch, n);
+  return checksum + table.size();
+}
+
+static void bench_parser_stages(size_t numreads)
+{
+  const size_t readlengths[] = { 100, 10000 };
+  const char *stages[NUM_STAGES] = {
+    "split lines", "+ parse FLAG/RNAME", "+ hash RNAME", "+ count (batch=32)"
+  };
+  PerfCounters counters;
+
+  printf("\nParser stages, per record (each stage includes those above it)\n");
+  if(!counters.available())
+    printf("hardware counters unavailable (see perf_event_paranoid); "
+           "reporting time only\n");
+  for(auto readlength : readlengths)
+  {
+    // Keep each buffer near 256 MB, and make up the requested number of
+    // records with repeated passes over it, the last over only the first
+    // `rest` records
+    size_t linelength = 2 * readlength + 64;
+    size_t numrecords = std::min(numreads, ((size_t)256 << 20) / linelength);
+    size_t passes = numreads / numrecords;
+    size_t rest = numreads % numrecords;
+    SamBuffer sam(100000, numrecords, readlength);
+    const char *text = sam.text.data(), *restend = text;
+    for(size_t i = 0; i < rest; i++)
+      restend = (const char *)memchr(restend, '\n',
+                                     text + sam.text.size() - restend) + 1;
+    size_t restbytes = restend - text;
+
+    printf("\nreads of %zu bases, %zu records x %zu passes + %zu\n",
+           readlength, numrecords, passes, rest);
+    printf("%20s%12s%12s%12s%12s%12s\n", "stage", "ns", "cycles",
+           "instr", "br-miss", "LLC-miss");
+    for(int stage = 0; stage < NUM_STAGES; stage++)
+    {
+      CountTable table;
+      run_stage(sam, sam.text.size(), stage, table);
+      uint64_t checksum = 0;
+      counters.start();
+      auto start = std::chrono::steady_clock::now();
+      for(size_t pass = 0; pass < passes; pass++)
+        checksum += run_stage(sam, sam.text.size(), stage, table);
+      if(rest > 0)
+        checksum += run_stage(sam, restbytes, stage, table);
+      double elapsed = seconds_since(start);
+      counters.stop();
+
+      printf("%20s%12.1f", stages[stage], elapsed * 1e9 / numreads);
+      for(int i = 0; i < PerfCounters::NUM_COUNTERS; i++)
+        counters.print(i, numreads);
+      printf("\n");
+      smr_bench_sink = checksum;
+    }
+  }
+}
+
+
+// Main method
+int main(int argc, char **argv)
+{
+  size_t numreads = 10000000;
+  if(argc > 1)
+    numreads = strtoul(argv[1], NULL, 10);
+
+  auto selected = [argc, argv](const char *section) {
+    if(argc <= 2)
+      return true;
+    for(int i = 2; i < argc; i++)
+    {
+      if(strcmp(argv[i], section) == 0)
+        return true;
+    }
+    return false;
+  };
+  if(selected("tables"))
+    bench_table_sizes(numreads);
+  if(selected("mphf"))
+    bench_header_index(numreads);
+  if(selected("threads"))
+    bench_thread_counts(numreads);
+  if(selected("rows"))
+    bench_row_numbering();
+  if(selected("parser"))
+    bench_parser_stages(numreads);
+  return 0;
+}
@@ -14,18 +14,77 @@ WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
 ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
 OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 
+
+SMR: SAM mapped reads
+
+This program is a command-line driver for libsmr (see smr.h).
+
+With --serve, SMR runs as a server on a Unix domain socket, keeping a worker
+pool warm between jobs, and the set of molecule IDs seen so far to presize
+tables with (see SmrEngine in smr.h). With --connect, SMR sends its job to
+such a server instead of counting itself. A job is the client's options
+followed by the absolute paths of its input files, each sent as a
+NUL-terminated string, and ended by an empty string. The server replies with
+a status byte, '0' or '1', followed by either the matrix of counts or an
+error message, and then closes the connection. A job that fails never stops
+the server, and a client that stalls for SMR_CLIENT_TIMEOUT seconds is
+dropped.
+
+`smr index` compiles a list of molecule IDs into a reference index file, which
+counting runs given --index map read-only instead of building tables.
+
+--region and --regions-file restrict counting to a set of molecules; in BAM
+files with a .bai index, only the compressed blocks holding them are read.
+
 */
 
+#include <errno.h>
 #include <getopt.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdio.h>
-#include "khash.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "smr.h"
 
 //------------------------------------------------------------------------------
 // Definitions/prototypes/initializations for data structures, functions, etc.
 //------------------------------------------------------------------------------
-#define MAX_LINE_LENGTH 8192
-#define MAX_ID_LENGTH 1024
-KHASH_MAP_INIT_STR(m32, unsigned)
+
+// Seconds a server waits on a stalled client, for its job or to take output,
+// before dropping it and serving the next one
+#define SMR_CLIENT_TIMEOUT 30
+
+enum
+{
+  SMR_OPT_IO_BUFFER = 256,
+  SMR_OPT_IO_DEPTH,
+  SMR_OPT_IO_ENGINE,
+  SMR_OPT_DROP_CACHE,
+  SMR_OPT_APPROX,
+  SMR_OPT_SKETCH_WIDTH,
+  SMR_OPT_TOP,
+  SMR_OPT_SUBSAMPLE,
+  SMR_OPT_SERVE,
+  SMR_OPT_CONNECT,
+  SMR_OPT_SPILL,
+  SMR_OPT_TRANSPOSE,
+  SMR_OPT_SORT,
+  SMR_OPT_IDS,
+  SMR_OPT_CHECKPOINT,
+  SMR_OPT_PROGRESS,
+  SMR_OPT_SNAPSHOT,
+  SMR_OPT_NORMALIZE,
+  SMR_OPT_WITH_RAW,
+  SMR_OPT_INDEX,
+  SMR_OPT_REGION,
+  SMR_OPT_REGIONS_FILE,
+};
 
 typedef struct
 {
@@ -33,15 +92,36 @@ typedef struct
   const char *outfile;
   FILE *outstream;
   unsigned numfiles;
+  const char *const *infiles;
+  const char *serve;
+  const char *connect;
+  const char *ids;
+  const char *checkpoint;
+  const char *snapshot;
+  const char *index;
+  FILE *errstream;  // where option errors are printed
+  const char **regions;
+  unsigned numregions;
+  SmrConfig config;
 } SmrOptions;
 
+// The counter whose snapshot SIGUSR1 requests
+static SmrCounter *smr_snapshot_counter = NULL;
+
+int smr_build_index(int argc, char **argv);
+int smr_connect(SmrOptions *options, int argc, char **argv);
+void smr_add_region(SmrOptions *options, const char *molid);
+void smr_free_regions(SmrOptions *options);
 void smr_init_options(SmrOptions *options);
-khash_t(m32) *smr_collect_molids(SmrOptions *options, khash_t(m32) **maps);
-khash_t(m32) *smr_load_file(const char *filename);
-void smr_parse_options(SmrOptions *options, int argc, char **argv);
-void smr_print_matrix(SmrOptions *options, khash_t(m32) **maps);
+void smr_open_output(SmrOptions *options);
+int smr_parse_options(SmrOptions *options, int argc, char **argv);
 void smr_print_usage(FILE *outstream);
-void smr_terminate(SmrOptions *options, khash_t(m32) **maps);
+int smr_read_regions(SmrOptions *options, const char *filename);
+int smr_serve(SmrOptions *options);
+void smr_serve_job(SmrEngine *engine, int conn);
+void smr_snapshot_signal(int signum);
+void smr_terminate(SmrOptions *options, SmrCounter *counter);
+int smr_unix_socket(const char *path, struct sockaddr_un *addr);
 
 //------------------------------------------------------------------------------
 // Main method
@@ -49,51 +129,209 @@ void smr_terminate(SmrOptions *options, khash_t(m32) **maps);
 
 int main(int argc, char **argv)
 {
+  if(argc > 1 && strcmp(argv[1], "index") == 0)
+    return smr_build_index(argc - 1, argv + 1);
+
   SmrOptions options;
   smr_init_options(&options);
-  smr_parse_options(&options, argc, argv);
+  int parsed = smr_parse_options(&options, argc, argv);
+  if(parsed != 0)
+    return parsed > 0 ? 0 : 1;
+  if(options.serve != NULL)
+    return smr_serve(&options);
 
-  unsigned i;
-  khash_t(m32) **maps = malloc( sizeof(void *) * options.numfiles );
-  for(i = 0; i < options.numfiles; i++)
-    maps[i] = smr_load_file(argv[optind+i]);
-  smr_print_matrix(&options, maps);
+  smr_open_output(&options);
+  if(options.connect != NULL)
+  {
+    int status = smr_connect(&options, argc, argv);
+    smr_terminate(&options, NULL);
+    return status;
+  }
+
+  SmrCounter *counter = smr_counter_new(&options.config);
+  if(counter == NULL)
+  {
+    fputs("error: invalid counting options\n", stderr);
+    exit(1);
+  }
+  if(options.snapshot != NULL)
+  {
+    smr_snapshot_counter = counter;
+    signal(SIGUSR1, smr_snapshot_signal);
+  }
+  if((options.ids != NULL && smr_counter_set_ids(counter, options.ids) < 0) ||
+     (options.numregions > 0 &&
+      smr_counter_set_regions(counter, options.regions,
+                              options.numregions) < 0) ||
+     (options.index != NULL &&
+      smr_counter_set_index(counter, options.index) < 0) ||
+     (options.checkpoint != NULL &&
+      smr_counter_set_checkpoint(counter, options.checkpoint) < 0) ||
+     (options.snapshot != NULL &&
+      smr_counter_set_snapshot(counter, options.snapshot, options.delim) < 0) ||
+     smr_counter_set_output(counter, options.outstream, options.delim) < 0 ||
+     smr_counter_count_files(counter, options.infiles, options.numfiles) < 0 ||
+     smr_counter_finish(counter) < 0)
+  {
+    fprintf(stderr, "%s\n", smr_counter_error(counter));
+    exit(1);
+  }
 
-  smr_terminate(&options, maps);
+  smr_terminate(&options, counter);
   return 0;
 }
 
 //------------------------------------------------------------------------------
 // Function implementations
 //------------------------------------------------------------------------------
-khash_t(m32) *smr_collect_molids(SmrOptions *options, khash_t(m32) **maps)
+int smr_build_index(int argc, char **argv)
 {
-  unsigned i;
-  khiter_t iter;
-  khash_t(m32) *ids = kh_init(m32);
-  for(i = 0; i < options->numfiles; i++)
+  const char *outfile = NULL;
+  const struct option index_options[] =
   {
-    for(iter = kh_begin(maps[i]); iter != kh_end(maps[i]); iter++)
+    { "help",    no_argument,       NULL, 'h' },
+    { "outfile", required_argument, NULL, 'o' },
+    { NULL,      no_argument,       NULL,  0  },
+  };
+  int opt;
+  while((opt = getopt_long(argc, argv, "ho:", index_options, NULL)) != -1)
+  {
+    if(opt == 'o')
+      outfile = optarg;
+    else
     {
-      if(!kh_exist(maps[i], iter))
-        continue;
-      const char *molid = kh_key(maps[i], iter);
-      khint_t key = kh_get(m32, ids, molid);
-      if(key == kh_end(ids))
-      {
-        int code;
-        key = kh_put(m32, ids, molid, &code);
-        if(!code)
-        {
-          fprintf(stderr, "error: failure storing key '%s'\n", molid);
-          kh_del(m32, ids, key);
-        }
-        else
-          kh_value(ids, key) = 1;
-      }
+      smr_print_usage(opt == 'h' ? stdout : stderr);
+      exit(opt == 'h' ? 0 : 1);
+    }
+  }
+  if(outfile == NULL || optind >= argc)
+  {
+    fputs("error: smr index needs -o FILE and 1 or more ID lists\n", stderr);
+    smr_print_usage(stderr);
+    exit(1);
+  }
+  if(smr_index_build(outfile, (const char *const *)argv + optind,
+                     argc - optind) < 0)
+  {
+    fprintf(stderr, "error building index %s: %s\n", outfile,
+            strerror(errno));
+    exit(1);
+  }
+  return 0;
+}
+
+int smr_connect(SmrOptions *options, int argc, char **argv)
+{
+  struct sockaddr_un addr;
+  int sock = smr_unix_socket(options->connect, &addr);
+  if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+  {
+    fprintf(stderr, "error: unable to connect to '%s': %s\n",
+            options->connect, strerror(errno));
+    exit(1);
+  }
+
+  // getopt_long has moved the options in front of the input files. Paths are
+  // sent absolute, since the server may run in another directory, and regions
+  // are sent one by one, as the client has already read any regions file.
+  FILE *job = fdopen(dup(sock), "w");
+  char path[PATH_MAX];
+  int i;
+  unsigned r;
+  for(i = 1; i < optind; i++)
+  {
+    if(strcmp(argv[i], "--ids") == 0 || strcmp(argv[i], "--index") == 0 ||
+       strcmp(argv[i], "--checkpoint") == 0 ||
+       strcmp(argv[i], "--region") == 0 ||
+       strcmp(argv[i], "--regions-file") == 0)
+      i++;
+    else if(strncmp(argv[i], "--ids=", 6) != 0 &&
+            strncmp(argv[i], "--index=", 8) != 0 &&
+            strncmp(argv[i], "--checkpoint=", 13) != 0 &&
+            strncmp(argv[i], "--region=", 9) != 0 &&
+            strncmp(argv[i], "--regions-file=", 15) != 0)
+      fwrite(argv[i], 1, strlen(argv[i]) + 1, job);
+  }
+  for(r = 0; r < options->numregions; r++)
+    fprintf(job, "--region=%s%c", options->regions[r], '\0');
+  if(options->ids != NULL)
+  {
+    if(realpath(options->ids, path) == NULL)
+    {
+      fprintf(stderr, "error opening ID file %s\n", options->ids);
+      exit(1);
+    }
+    fprintf(job, "--ids=%s%c", path, '\0');
+  }
+  if(options->index != NULL)
+  {
+    if(realpath(options->index, path) == NULL)
+    {
+      fprintf(stderr, "error opening index %s\n", options->index);
+      exit(1);
+    }
+    fprintf(job, "--index=%s%c", path, '\0');
+  }
+  if(options->checkpoint != NULL)
+  {
+    mkdir(options->checkpoint, 0777);
+    if(realpath(options->checkpoint, path) == NULL)
+    {
+      fprintf(stderr, "error creating checkpoint directory %s\n",
+              options->checkpoint);
+      exit(1);
+    }
+    fprintf(job, "--checkpoint=%s%c", path, '\0');
+  }
+  for(i = optind; i < argc; i++)
+  {
+    if(realpath(argv[i], path) == NULL)
+    {
+      fprintf(stderr, "error opening file %s\n", argv[i]);
+      exit(1);
+    }
+    fwrite(path, 1, strlen(path) + 1, job);
+  }
+  fputc('\0', job);
+  fclose(job);
+  shutdown(sock, SHUT_WR);
+
+  char buffer[65536];
+  ssize_t len;
+  int status = -1;
+  while((len = read(sock, buffer, sizeof(buffer))) > 0)
+  {
+    const char *data = buffer;
+    if(status < 0)
+    {
+      status = (buffer[0] == '0') ? 0 : 1;
+      data++;
+      len--;
     }
+    fwrite(data, 1, len, status == 0 ? options->outstream : stderr);
   }
-  return ids;
+  close(sock);
+  if(status < 0)
+    fputs("error: no reply from server\n", stderr);
+  return status == 0 ? 0 : 1;
+}
+
+// Regions are copied, so that smr_free_regions() can free every one of them
+void smr_add_region(SmrOptions *options, const char *molid)
+{
+  options->regions = realloc(options->regions,
+                             sizeof(char *) * (options->numregions + 1));
+  options->regions[options->numregions++] = strdup(molid);
+}
+
+void smr_free_regions(SmrOptions *options)
+{
+  unsigned i;
+  for(i = 0; i < options->numregions; i++)
+    free((char *)options->regions[i]);
+  free(options->regions);
+  options->regions = NULL;
+  options->numregions = 0;
 }
 
 void smr_init_options(SmrOptions *options)
@@ -102,174 +340,627 @@ void smr_init_options(SmrOptions *options)
   options->outfile    = "stdout";
   options->outstream  = stdout;
   options->numfiles   = 0;
+  options->infiles    = NULL;
+  options->serve      = NULL;
+  options->connect    = NULL;
+  options->ids        = NULL;
+  options->checkpoint = NULL;
+  options->snapshot   = NULL;
+  options->index      = NULL;
+  options->errstream  = stderr;
+  options->regions    = NULL;
+  options->numregions = 0;
+  smr_config_init(&options->config);
 }
 
-khash_t(m32) *smr_load_file(const char *filename)
+void smr_open_output(SmrOptions *options)
 {
-  FILE *instream = fopen(filename, "r");
-  if(instream == NULL)
+  size_t len = strlen(options->outfile);
+  if(strcmp(options->outfile, "stdout") == 0)
+    return;
+  if(len > 3 && strcmp(options->outfile + len - 3, ".gz") == 0)
+    options->outstream = smr_bgzf_open(options->outfile,
+                                       options->config.numthreads);
+  else
+    options->outstream = fopen(options->outfile, "w");
+  if(options->outstream == NULL)
   {
-    fprintf(stderr, "error opening file '%s'\n", filename);
+    fprintf(stderr, "error: unable to open output file '%s'\n",
+            options->outfile);
     exit(1);
   }
-
-  khash_t(m32) *map = kh_init(m32);
-  char buffer[MAX_LINE_LENGTH];
-  while(fgets(buffer, MAX_LINE_LENGTH, instream) != NULL)
-  {
-    const char *tok = strtok(buffer, "\t\n");
-    tok = strtok(NULL, "\t\n");
-    int bflag = atoi(tok);
-    if(bflag & 0x4)
-      continue;
-
-    tok = strtok(NULL, "\t\n");
-    khint_t key = kh_get(m32, map, tok);
-
-    if(key == kh_end(map))
-    {
-      int code;
-      const char *molid = strdup(tok);
-      key = kh_put(m32, map, molid, &code);
-      if(!code)
-      {
-        fprintf(stderr, "error: failure storing key '%s'\n", molid);
-        kh_del(m32, map, key);
-      }
-      else
-        kh_value(map, key) = 0;
-    }
-    unsigned tsareadcount = kh_value(map, key);
-    kh_value(map, key) = tsareadcount + 1;
-  }
-
-  fclose(instream);
-  return map;
 }
 
-void smr_parse_options(SmrOptions *options, int argc, char **argv)
+// Returns 0 if the options are valid, 1 if help was printed, or -1 after
+// printing an error to options->errstream. Nothing here exits, since a server
+// parses the options of every job.
+int smr_parse_options(SmrOptions *options, int argc, char **argv)
 {
+  FILE *errstream = options->errstream;
   int opt = 0;
   int optindex = 0;
-  const char *optstr = "d:ho:";
+  SmrConfig *config = &options->config;
+  const char *optstr = "b:c:d:hmo:p:s";
   const struct option smr_options[] =
   {
-    { "delim",   required_argument, NULL, 'd' },
-    { "help",    no_argument,       NULL, 'h' },
-    { "outfile", required_argument, NULL, 'o' },
-    { NULL,      no_argument,       NULL,  0  },
+    { "batch",        required_argument, NULL, 'b' },
+    { "chunk-size",   required_argument, NULL, 'c' },
+    { "delim",        required_argument, NULL, 'd' },
+    { "help",         no_argument,       NULL, 'h' },
+    { "perfect-hash", no_argument,       NULL, 'm' },
+    { "outfile",      required_argument, NULL, 'o' },
+    { "threads",      required_argument, NULL, 'p' },
+    { "shared",       no_argument,       NULL, 's' },
+    { "io-buffer",    required_argument, NULL, SMR_OPT_IO_BUFFER },
+    { "io-depth",     required_argument, NULL, SMR_OPT_IO_DEPTH },
+    { "io-engine",    required_argument, NULL, SMR_OPT_IO_ENGINE },
+    { "drop-cache",   no_argument,       NULL, SMR_OPT_DROP_CACHE },
+    { "approx",       no_argument,       NULL, SMR_OPT_APPROX },
+    { "sketch-width", required_argument, NULL, SMR_OPT_SKETCH_WIDTH },
+    { "top",          required_argument, NULL, SMR_OPT_TOP },
+    { "subsample",    required_argument, NULL, SMR_OPT_SUBSAMPLE },
+    { "serve",        required_argument, NULL, SMR_OPT_SERVE },
+    { "connect",      required_argument, NULL, SMR_OPT_CONNECT },
+    { "spill",        no_argument,       NULL, SMR_OPT_SPILL },
+    { "transpose",    no_argument,       NULL, SMR_OPT_TRANSPOSE },
+    { "sort",         required_argument, NULL, SMR_OPT_SORT },
+    { "ids",          required_argument, NULL, SMR_OPT_IDS },
+    { "checkpoint",   required_argument, NULL, SMR_OPT_CHECKPOINT },
+    { "progress",     optional_argument, NULL, SMR_OPT_PROGRESS },
+    { "snapshot",     required_argument, NULL, SMR_OPT_SNAPSHOT },
+    { "normalize",    required_argument, NULL, SMR_OPT_NORMALIZE },
+    { "with-raw",     no_argument,       NULL, SMR_OPT_WITH_RAW },
+    { "index",        required_argument, NULL, SMR_OPT_INDEX },
+    { "region",       required_argument, NULL, SMR_OPT_REGION },
+    { "regions-file", required_argument, NULL, SMR_OPT_REGIONS_FILE },
+    { NULL,           no_argument,       NULL,  0  },
   };
 
+  optind = 0;  // servers parse the options of every job
   for(opt = getopt_long(argc, argv, optstr, smr_options, &optindex);
       opt != -1;
       opt = getopt_long(argc, argv, optstr, smr_options, &optindex))
   {
     switch(opt)
     {
+      case 'b':
+        config->batchsize = atoi(optarg);
+        if(config->batchsize < 1 || config->batchsize > 256)
+        {
+          fputs("error: batch size must be between 1 and 256\n", errstream);
+          return -1;
+        }
+        break;
+      case 'c':
+        if(atoi(optarg) < 1)
+        {
+          fputs("error: chunk size must be 1 MB or more\n", errstream);
+          return -1;
+        }
+        config->chunksize = (size_t)atoi(optarg) << 20;
+        break;
       case 'd':
         if(strcmp(optarg, "\\t") == 0)
           optarg = "\t";
         else if(strlen(optarg) > 1)
         {
-          fprintf(stderr, "warning: string '%s' provided for delimiter, using "
-                  "only '%c'\n", optarg, optarg[0]);
+          fprintf(errstream, "warning: string '%s' provided for delimiter, "
+                  "using only '%c'\n", optarg, optarg[0]);
         }
         options->delim = optarg[0];
         break;
       case 'h':
         smr_print_usage(stdout);
-        exit(0);
+        return 1;
+      case 'm':
+        config->perfecthash = 1;
         break;
       case 'o':
         options->outfile = optarg;
         break;
-      default:
-        fprintf(stderr, "error: unknown option '%c'\n", opt);
-        smr_print_usage(stderr);
+      case 'p':
+        if(atoi(optarg) < 1)
+        {
+          fputs("error: number of threads must be 1 or more\n", errstream);
+          return -1;
+        }
+        config->numthreads = atoi(optarg);
+        break;
+      case 's':
+        config->sharedtable = 1;
+        break;
+      case SMR_OPT_IO_BUFFER:
+        if(atoi(optarg) < 4)
+        {
+          fputs("error: I/O buffer size must be 4 KB or more\n", errstream);
+          return -1;
+        }
+        config->iobuffer = (size_t)atoi(optarg) << 10;
+        break;
+      case SMR_OPT_IO_DEPTH:
+        config->iodepth = atoi(optarg);
+        if(config->iodepth < 1 || config->iodepth > 256)
+        {
+          fputs("error: I/O queue depth must be between 1 and 256\n", errstream);
+          return -1;
+        }
+        break;
+      case SMR_OPT_IO_ENGINE:
+        if(strcmp(optarg, "auto") == 0)
+          config->ioengine = SMR_IO_AUTO;
+        else if(strcmp(optarg, "uring") == 0)
+          config->ioengine = SMR_IO_URING;
+        else if(strcmp(optarg, "pread") == 0)
+          config->ioengine = SMR_IO_PREAD;
+        else
+        {
+          fprintf(errstream, "error: unknown I/O engine '%s'\n", optarg);
+          return -1;
+        }
         break;
+      case SMR_OPT_DROP_CACHE:
+        config->dropcache = 1;
+        break;
+      case SMR_OPT_APPROX:
+        config->approx = 1;
+        break;
+      case SMR_OPT_SKETCH_WIDTH:
+        if(atol(optarg) < 1)
+        {
+          fputs("error: sketch width must be 1 or more\n", errstream);
+          return -1;
+        }
+        config->sketchwidth = atol(optarg);
+        break;
+      case SMR_OPT_TOP:
+        if(atol(optarg) < 1)
+        {
+          fputs("error: heavy-hitter list size must be 1 or more\n", errstream);
+          return -1;
+        }
+        config->toplist = atol(optarg);
+        break;
+      case SMR_OPT_SUBSAMPLE:
+        config->subsample = atof(optarg);
+        if(!(config->subsample > 0.0 && config->subsample <= 1.0))
+        {
+          fputs("error: subsample fraction must be greater than 0 and at "
+                "most 1\n", errstream);
+          return -1;
+        }
+        break;
+      case SMR_OPT_SERVE:
+        options->serve = optarg;
+        break;
+      case SMR_OPT_CONNECT:
+        options->connect = optarg;
+        break;
+      case SMR_OPT_SPILL:
+        config->spill = 1;
+        break;
+      case SMR_OPT_TRANSPOSE:
+        config->transpose = 1;
+        break;
+      case SMR_OPT_SORT:
+        if(strcmp(optarg, "name") == 0)
+          config->sort = SMR_SORT_NAME;
+        else if(strcmp(optarg, "natural") == 0)
+          config->sort = SMR_SORT_NATURAL;
+        else if(strcmp(optarg, "header") == 0)
+          config->sort = SMR_SORT_HEADER;
+        else if(strcmp(optarg, "count") == 0)
+          config->sort = SMR_SORT_COUNT;
+        else
+        {
+          fprintf(errstream, "error: unknown sort order '%s'\n", optarg);
+          return -1;
+        }
+        break;
+      case SMR_OPT_IDS:
+        options->ids = optarg;
+        break;
+      case SMR_OPT_CHECKPOINT:
+        options->checkpoint = optarg;
+        break;
+      case SMR_OPT_PROGRESS:
+        config->progress = optarg ? atoi(optarg) : 5;
+        if(config->progress < 1)
+        {
+          fputs("error: progress interval must be 1 second or more\n",
+                errstream);
+          return -1;
+        }
+        break;
+      case SMR_OPT_SNAPSHOT:
+        options->snapshot = optarg;
+        break;
+      case SMR_OPT_NORMALIZE:
+        if(strcmp(optarg, "cpm") == 0)
+          config->normalize = SMR_NORMALIZE_CPM;
+        else if(strcmp(optarg, "rpkm") == 0)
+          config->normalize = SMR_NORMALIZE_RPKM;
+        else
+        {
+          fprintf(errstream, "error: unknown normalization '%s'\n", optarg);
+          return -1;
+        }
+        break;
+      case SMR_OPT_WITH_RAW:
+        config->withraw = 1;
+        break;
+      case SMR_OPT_INDEX:
+        options->index = optarg;
+        break;
+      case SMR_OPT_REGION:
+        smr_add_region(options, optarg);
+        break;
+      case SMR_OPT_REGIONS_FILE:
+        if(smr_read_regions(options, optarg) < 0)
+          return -1;
+        break;
+      default:
+        fprintf(errstream, "error: unknown option '%c'\n", opt);
+        smr_print_usage(errstream);
+        return -1;
     }
   }
 
-  if(strcmp(options->outfile, "stdout") != 0)
+  if(config->approx && (config->spill || config->transpose))
   {
-    options->outstream = fopen(options->outfile, "w");
-    if(options->outstream == NULL)
-    {
-      fprintf(stderr, "error: unable to open output file '%s'\n",
-              options->outfile);
-      exit(1);
-    }
+    fputs("error: --approx cannot be combined with --spill or --transpose\n",
+          errstream);
+    return -1;
   }
-
-  options->numfiles = argc - optind;
-  if(options->numfiles < 1)
+  if(config->normalize != SMR_NORMALIZE_NONE &&
+     (config->approx || config->transpose))
   {
-    fputs("expected 1 or more input files\n", stderr);
-    smr_print_usage(stderr);
-    exit(1);
+    fputs("error: --normalize cannot be combined with --approx or "
+          "--transpose\n", errstream);
+    return -1;
   }
-}
-
-void smr_print_matrix(SmrOptions *options, khash_t(m32) **maps)
-{
-  khiter_t iter;
-  unsigned i;
-  khash_t(m32) *molids = smr_collect_molids(options, maps);
-  for(iter = kh_begin(molids); iter != kh_end(molids); iter++)
+  if(options->index != NULL && (config->approx || config->perfecthash))
   {
-    if(!kh_exist(molids, iter))
-      continue;
-    const char *molid = kh_key(molids, iter);
+    fputs("error: --index cannot be combined with --approx or -m\n", errstream);
+    return -1;
+  }
+  if(config->normalize != SMR_NORMALIZE_NONE &&
+     (options->ids != NULL || options->numregions > 0))
+  {
+    fputs("error: --normalize cannot be combined with --ids, --region or "
+          "--regions-file\n", errstream);
+    return -1;
+  }
+  if(options->ids != NULL && options->numregions > 0)
+  {
+    fputs("error: --ids cannot be combined with --region or "
+          "--regions-file\n", errstream);
+    return -1;
+  }
+  if(config->withraw && config->normalize == SMR_NORMALIZE_NONE)
+  {
+    fputs("error: --with-raw requires --normalize\n", errstream);
+    return -1;
+  }
+  if(options->snapshot != NULL &&
+     (config->spill || config->transpose || options->connect != NULL))
+  {
+    fputs("error: --snapshot cannot be combined with --spill, --transpose or "
+          "--connect\n", errstream);
+    return -1;
+  }
+  if(options->checkpoint != NULL &&
+     (config->approx || config->sharedtable || config->perfecthash))
+  {
+    fputs("error: --checkpoint cannot be combined with --approx, -m or -s\n",
+          errstream);
+    return -1;
+  }
 
-    fprintf(options->outstream, "%s%c", molid, options->delim);
-    for(i = 0; i < options->numfiles; i++)
-    {
-      if(i > 0)
-        fputc(options->delim, options->outstream);
-
-      khint_t key = kh_get(m32, maps[i], molid);
-      if(key == kh_end(maps[i]))
-        fputc('0', options->outstream);
-      else
-      {
-        unsigned readcount = kh_value(maps[i], key);
-        fprintf(options->outstream, "%u", readcount);
-      }
-    }
-    fputc('\n', options->outstream);
+  options->numfiles = argc - optind;
+  if(options->numfiles < 1 && options->serve == NULL)
+  {
+    fputs("expected 1 or more input files\n", errstream);
+    smr_print_usage(errstream);
+    return -1;
   }
-  kh_destroy(m32, molids);
+  options->infiles = (const char *const *)argv + optind;
+  return 0;
 }
 
 void smr_print_usage(FILE *outstream)
 {
   fputs("\nSMR: SAM mapped reads\n\n"
-"The input to SMR is 1 or more SAM files. The output is a table (1 column for\n"
-"each input file) showing the number of reads that map to each sequence.\n\n"
+"The input to SMR is 1 or more SAM or BAM files. The output is a table (1\n"
+"column for each input file) showing the number of reads that map to each\n"
+"sequence.\n\n"
 "Usage: smr [options] sample-1.sam sample-2.sam ... sample-n.sam\n"
+"       smr index -o FILE ids-1 ids-2 ... ids-n\n"
 "  Options:\n"
+"    -b|--batch: NUM          number of records whose table lookups are\n"
+"                             batched and prefetched together; default is 32,\n"
+"                             1 disables batching\n"
+"    -c|--chunk-size: NUM     with -p, --checkpoint or --snapshot, files\n"
+"                             larger than NUM MB are split into chunks of\n"
+"                             that size, each a separate task (and\n"
+"                             checkpoint); default is 64\n"
 "    -d|--delim: CHAR         delimiter for output data; default is comma\n"
 "    -h|--help                print this help message and exit\n"
+"    -m|--perfect-hash        build a minimal perfect hash over the @SQ\n"
+"                             molecule IDs in each file's header, and count\n"
+"                             reads in a dense array\n"
 "    -o|--outfile: FILE       name of file to which read counts will be\n"
-"                             written; default is terminal (stdout)\n",
+"                             written; default is terminal (stdout); a name\n"
+"                             ending in .gz is written as BGZF (blocked\n"
+"                             gzip), compressed on -p threads\n"
+"    -p|--threads: NUM        number of counting threads, shared by all files;\n"
+"                             idle threads steal work from busy ones; default\n"
+"                             is 1\n"
+"    -s|--shared              with -p, count each file in a single table\n"
+"                             shared by all threads rather than in one table\n"
+"                             per task\n"
+"    --io-buffer: NUM         size of each input read, in KB; default is 1024\n"
+"    --io-depth: NUM          number of input reads kept in flight per file\n"
+"                             being counted; default is 4\n"
+"    --io-engine: ENGINE      'uring', 'pread' (a helper thread per read in\n"
+"                             flight), or 'auto' to use io_uring when the\n"
+"                             system supports it; default is auto\n"
+"    --drop-cache             drop input pages from the page cache once they\n"
+"                             have been counted\n"
+"    --approx                 estimate counts in a fixed-size count-min sketch\n"
+"                             per file, reporting only the molecules with the\n"
+"                             largest estimates (see --top); an error bound\n"
+"                             for each column is printed before the counts\n"
+"    --sketch-width: NUM      counters in each of the 4 rows of the sketch,\n"
+"                             rounded up to a power of 2 of at least 1024;\n"
+"                             default is 1048576\n"
+"    --top: NUM               with --approx, number of molecules reported per\n"
+"                             file; default is 1000\n"
+"    --subsample: FRACTION    count only the reads whose QNAME hashes into the\n"
+"                             given fraction, keeping mates together, and\n"
+"                             scale counts up accordingly\n"
+"    --serve: SOCKET          listen for jobs on a Unix domain socket, keeping\n"
+"                             -p worker threads warm, and presizing tables\n"
+"                             for the molecules of earlier jobs; no input\n"
+"                             files are given\n"
+"    --connect: SOCKET        send this job to a server started with --serve\n"
+"                             rather than counting in this process\n"
+"    --spill                  write each file's counts to a temporary spill\n"
+"                             file and free them as soon as the file is\n"
+"                             counted, then assemble the table from the spill;\n"
+"                             for very many input files\n"
+"    --transpose              print a '#molecules' line naming one column per\n"
+"                             molecule, then one line per input file, in the\n"
+"                             order given; columns are sorted by name unless\n"
+"                             --sort or --ids is given\n"
+"    --sort: ORDER            print rows (columns with --transpose) sorted by\n"
+"                             'name', 'natural' (numbers within names by\n"
+"                             value, so chr2 before chr10), 'header' (the @SQ\n"
+"                             order of the first file that declares each\n"
+"                             molecule) or 'count' (largest total first);\n"
+"                             default is hash order\n"
+"    --ids: FILE              count only the molecules listed in FILE, one ID\n"
+"                             per line, and report every one of them (even\n"
+"                             with no reads) in the order listed, unless\n"
+"                             --sort is given\n"
+"    --checkpoint: DIR        save the counts of each file, and of each -c\n"
+"                             chunk of a file, in DIR as soon as they are\n"
+"                             done; rerunning the same command loads them\n"
+"                             instead of counting again\n"
+"    --progress[=SECONDS]     report the bytes read from each file, records\n"
+"                             per second and the time left on stderr, every\n"
+"                             SECONDS seconds; default is 5\n"
+"    --snapshot: FILE         on SIGUSR1, write the counts so far to FILE\n"
+"                             while counting goes on; files still being read\n"
+"                             are included for the chunks already merged\n"
+"    --normalize: METHOD      print 'cpm' (counts per million reads counted in\n"
+"                             the file) or 'rpkm' (per kilobase of molecule,\n"
+"                             from @SQ LN: or --index, per million reads)\n"
+"                             instead of raw counts; as the reads left out by\n"
+"                             --ids or --region would not count toward the\n"
+"                             million, it cannot be combined with them\n"
+"    --with-raw               with --normalize, print each raw count followed\n"
+"                             by its normalized value\n"
+"    --index: FILE            count against a reference index built by 'smr\n"
+"                             index', mapped read-only and shared with other\n"
+"                             runs, instead of building tables from scratch\n"
+"    --region: ID             count only the reads mapped to molecule ID, and\n"
+"                             report it even with no reads; may be repeated.\n"
+"                             In a BAM file with a .bai index, only the\n"
+"                             compressed blocks holding these reads are read\n"
+"    --regions-file: FILE     as --region, for each ID listed in FILE, one per\n"
+"                             line (anything after the first space or tab is\n"
+"                             ignored, so BED files can be given)\n\n"
+"  smr index compiles the molecule IDs of SAM headers (@SQ lines) or of ID\n"
+"  lists (one ID per line, optionally followed by its length, as in a .fai\n"
+"  file) into a reference index FILE; lengths are used by --normalize=rpkm.\n\n",
         outstream);
 }
 
-void smr_terminate(SmrOptions *options, khash_t(m32) **maps)
+int smr_read_regions(SmrOptions *options, const char *filename)
 {
-  unsigned i;
-  khint_t iter;
-  for(i = 0; i < options->numfiles; i++)
+  FILE *errstream = options->errstream;
+  FILE *instream = fopen(filename, "r");
+  if(instream == NULL)
   {
-    for(iter = kh_begin(maps[i]); iter != kh_end(maps[i]); iter++)
+    fprintf(errstream, "error opening regions file %s\n", filename);
+    return -1;
+  }
+  unsigned numregions = options->numregions;
+  char *line = NULL;
+  size_t capacity = 0;
+  while(getline(&line, &capacity, instream) > 0)
+  {
+    size_t len = strcspn(line, " \t\r\n");
+    if(len == 0 || line[0] == '#')
+      continue;
+    line[len] = '\0';
+    smr_add_region(options, line);
+  }
+  free(line);
+  fclose(instream);
+  if(options->numregions == numregions)
+  {
+    fprintf(errstream, "error: no regions in %s\n", filename);
+    return -1;
+  }
+  return 0;
+}
+
+int smr_serve(SmrOptions *options)
+{
+  struct sockaddr_un addr;
+  int sock = smr_unix_socket(options->serve, &addr);
+  unlink(options->serve);
+  if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+     listen(sock, 16) < 0)
+  {
+    fprintf(stderr, "error: unable to listen on '%s': %s\n", options->serve,
+            strerror(errno));
+    exit(1);
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  SmrEngine *engine = smr_engine_new(options->config.numthreads);
+  while(1)
+  {
+    int conn = accept(sock, NULL, NULL);
+    if(conn < 0)
     {
-      if(!kh_exist(maps[i], iter))
+      if(errno == EINTR || errno == ECONNABORTED)
         continue;
-      char *molid = (char *)kh_key(maps[i], iter);
-      free(molid);
+      fprintf(stderr, "error: accept failed: %s\n", strerror(errno));
+      break;
+    }
+    struct timeval timeout = { SMR_CLIENT_TIMEOUT, 0 };
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    smr_serve_job(engine, conn);
+    close(conn);
+  }
+  smr_engine_free(engine);
+  close(sock);
+  return 1;
+}
+
+void smr_serve_job(SmrEngine *engine, int conn)
+{
+  size_t size = 0, capacity = 4096;
+  char *job = malloc(capacity);
+  ssize_t len;
+  while((len = read(conn, job + size, capacity - size)) > 0)
+  {
+    size += len;
+    if(size >= 2 && job[size - 1] == '\0' && job[size - 2] == '\0')
+      break;
+    if(size == capacity)
+      job = realloc(job, capacity *= 2);
+  }
+  if(size < 2 || job[size - 1] != '\0' || job[size - 2] != '\0')
+  {
+    free(job);
+    return;
+  }
+
+  int argc = 1;
+  char **argv = malloc(sizeof(char *) * (size + 2));
+  argv[0] = "smr";
+  char *arg;
+  for(arg = job; arg < job + size - 1; arg += strlen(arg) + 1)
+    argv[argc++] = arg;
+  argv[argc] = NULL;
+
+  // Options are checked again, as a job need not come from smr --connect;
+  // their errors are sent back rather than printed
+  SmrOptions options;
+  char *errors = NULL;
+  size_t errsize = 0;
+  smr_init_options(&options);
+  options.errstream = open_memstream(&errors, &errsize);
+  int parsed = smr_parse_options(&options, argc, argv);
+  fclose(options.errstream);
+
+  // Check that the files can be read, and set up everything else that can
+  // fail, before answering
+  FILE *reply = fdopen(dup(conn), "w");
+  SmrCounter *counter = NULL;
+  if(parsed == 0)
+    counter = smr_counter_new_warm(engine, &options.config);
+  unsigned i;
+  for(i = 0; parsed == 0 && i < options.numfiles; i++)
+  {
+    if(access(options.infiles[i], R_OK) != 0)
+      break;
+  }
+  if(parsed != 0)
+    fprintf(reply, "1%s", parsed < 0 ? errors : "error: invalid options\n");
+  else if(counter == NULL)
+    fputs("1error: invalid counting options\n", reply);
+  else if(i < options.numfiles)
+    fprintf(reply, "1error opening file %s\n", options.infiles[i]);
+  else if((options.ids != NULL &&
+           smr_counter_set_ids(counter, options.ids) < 0) ||
+          (options.numregions > 0 &&
+           smr_counter_set_regions(counter, options.regions,
+                                   options.numregions) < 0) ||
+          (options.index != NULL &&
+           smr_counter_set_index(counter, options.index) < 0) ||
+          (options.checkpoint != NULL &&
+           smr_counter_set_checkpoint(counter, options.checkpoint) < 0))
+    fprintf(reply, "1%s\n", smr_counter_error(counter));
+  else
+  {
+    // Nothing is written until the counter is finished, so a counting error
+    // can still be answered with '1'
+    if(smr_counter_set_output(counter, reply, options.delim) < 0 ||
+       smr_counter_count_files(counter, options.infiles,
+                               options.numfiles) < 0)
+      fprintf(reply, "1%s\n", smr_counter_error(counter));
+    else
+    {
+      fputc('0', reply);
+      if(smr_counter_finish(counter) < 0)
+        fprintf(reply, "%s\n", smr_counter_error(counter));
     }
-    kh_destroy(m32, maps[i]);
   }
-  free(maps);
+  fclose(reply);
+  free(errors);
+  smr_counter_free(counter);
+  smr_free_regions(&options);
+  free(argv);
+  free(job);
+}
+
+void smr_snapshot_signal(int signum)
+{
+  (void)signum;
+  if(smr_snapshot_counter != NULL)
+    smr_counter_request_snapshot(smr_snapshot_counter);
+}
+
+void smr_terminate(SmrOptions *options, SmrCounter *counter)
+{
+  if(counter != NULL)
+    smr_counter_free(counter);
   fclose(options->outstream);
+  smr_free_regions(options);
+}
+
+int smr_unix_socket(const char *path, struct sockaddr_un *addr)
+{
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof(addr->sun_path))
+  {
+    fprintf(stderr, "error: socket path '%s' is too long\n", path);
+    exit(1);
+  }
+  strcpy(addr->sun_path, path);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(sock < 0)
+  {
+    fprintf(stderr, "error: unable to create socket: %s\n", strerror(errno));
+    exit(1);
+  }
+  return sock;
 }
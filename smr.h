@@ -0,0 +1,226 @@
+/*
+
+Copyright (c) 2013, Daniel S. Standage <daniel.standage@gmail.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+
+libsmr: SAM mapped reads, as a library
+
+A counter holds one read tally per sample. Samples are filled either by
+counting SAM or BAM files (on a thread pool, see smr_counter_count_files) or by
+pushing SAM text into them from memory, in buffers of any size or one record
+at a time. Once every sample is filled, the counter is finished and the matrix
+of read counts (one row per molecule, one column per sample) is exported or
+printed.
+
+Pushing does not allocate per record: molecule IDs are counted straight from
+the caller's buffer, or from a staging area owned by the sample that is reused
+for every batch. Different samples may be pushed from different threads at
+once; pushes to the same sample must not overlap.
+
+Functions that can fail return a negative value (or NULL) and leave a message
+for smr_counter_error(). Errors reading a file after it was opened are fatal.
+
+*/
+
+#ifndef SMR_H
+#define SMR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SMR_IO_AUTO  0
+#define SMR_IO_URING 1
+#define SMR_IO_PREAD 2
+
+#define SMR_SORT_NONE    0
+#define SMR_SORT_NAME    1
+#define SMR_SORT_NATURAL 2
+#define SMR_SORT_HEADER  3
+#define SMR_SORT_COUNT   4
+
+#define SMR_NORMALIZE_NONE 0
+#define SMR_NORMALIZE_CPM  1
+#define SMR_NORMALIZE_RPKM 2
+
+
+/**
+ * @type SmrConfig
+ *
+ * Counting options shared by every sample of a counter; initialize with
+ * smr_config_init() before changing any field.
+ */
+typedef struct
+{
+  unsigned batchsize;    // records hashed and prefetched together, at most 256
+  int perfecthash;       // count in a perfect hash of the @SQ header IDs
+  unsigned numthreads;   // threads used by smr_counter_count_files()
+  int sharedtable;       // threads counting one file share a lock-free table
+  size_t chunksize;      // files larger than this are split into tasks
+  unsigned iodepth;      // reads kept in flight per file
+  size_t iobuffer;       // size of each read, in bytes
+  int ioengine;          // SMR_IO_AUTO, SMR_IO_URING or SMR_IO_PREAD
+  int dropcache;         // drop counted input from the page cache
+  int approx;            // count in a count-min sketch per sample
+  size_t sketchwidth;    // counters per sketch row
+  size_t toplist;        // molecules reported per sample with approx
+  double subsample;      // fraction of read names kept, in (0, 1]
+  int spill;             // with an output, spill finished columns to disk
+  int transpose;         // with an output, write one line per sample
+  int sort;              // row order, one of the SMR_SORT_* values
+  unsigned progress;     // seconds between progress reports on stderr, or 0
+  int normalize;         // printed values, one of the SMR_NORMALIZE_* values
+  int withraw;           // with normalize, print raw counts alongside
+} SmrConfig;
+
+void smr_config_init(SmrConfig *config);
+
+
+/**
+ * @type SmrMatrix
+ *
+ * Read counts exported from a finished counter, owned by the counter. Counts
+ * are stored row by row: the count of molecule `i` in sample `j` is
+ * counts[i * numsamples + j]. With approx, bounds[j] is the error bound of
+ * column `j`; otherwise bounds is NULL. With config->normalize, values holds
+ * the CPM or RPKM value of each count, in the same layout (NaN for the RPKM
+ * of a molecule whose length no @SQ line gives); otherwise values is NULL.
+ */
+typedef struct
+{
+  size_t numrows;
+  unsigned numsamples;
+  const char *const *molids;
+  const uint64_t *counts;
+  const uint64_t *bounds;
+  const double *values;
+} SmrMatrix;
+
+
+typedef struct SmrCounter SmrCounter;
+typedef struct SmrEngine SmrEngine;
+
+SmrCounter *smr_counter_new(const SmrConfig *config);
+void smr_counter_free(SmrCounter *counter);
+const char *smr_counter_error(const SmrCounter *counter);
+
+// Add an empty sample, returning its column index
+int smr_counter_add_sample(SmrCounter *counter, const char *name);
+
+// Add one sample per file, in order, and count them all
+int smr_counter_count_files(SmrCounter *counter, const char *const *filenames,
+                            unsigned numfiles);
+
+// Count SAM text: any number of lines, with the last one possibly continued in
+// the next buffer. Header lines must come before the first alignment.
+int smr_counter_push_buffer(SmrCounter *counter, int sample, const char *data,
+                            size_t len);
+
+// Count one SAM line, with or without its newline
+int smr_counter_push_record(SmrCounter *counter, int sample, const char *line,
+                            size_t len);
+
+// Count any partial last lines and combine each sample's counts; nothing can
+// be added to the counter afterwards. Returns -1 if a checkpoint or the spill
+// file cannot be written.
+int smr_counter_finish(SmrCounter *counter);
+
+int smr_counter_export(SmrCounter *counter, SmrMatrix *matrix);
+int smr_counter_print(SmrCounter *counter, FILE *outstream, char delim);
+
+// Write the counts to `outstream`; must be called before any sample is
+// added. The matrix is printed by smr_counter_finish(). With config->spill or
+// config->transpose, each sample is written to a spill file and freed as soon
+// as it is finished, and the counter can no longer be exported or printed.
+// The transposed layout has one line per sample, in the order added, with
+// columns sorted by config->sort, or by name without a sort or allowlist.
+// Neither layout can be combined with approx.
+int smr_counter_set_output(SmrCounter *counter, FILE *outstream, char delim);
+
+// While files are counted, write the counts so far to `filename` whenever
+// smr_counter_request_snapshot() is called, without pausing the counting
+// threads; see ReadTallyMatrix::write_snapshot(). Cannot be combined with
+// config->spill or config->transpose. Files are split into chunks of
+// config->chunksize, as with several threads, so a snapshot taken while a
+// large file is counted includes its chunks merged so far. Requesting a
+// snapshot only sets a flag, so it is safe to call from a signal handler.
+int smr_counter_set_snapshot(SmrCounter *counter, const char *filename,
+                             char delim);
+void smr_counter_request_snapshot(SmrCounter *counter);
+
+// Save the counts of each file counted by smr_counter_count_files() in
+// directory `dirname` (created if needed), and of each chunk of a file as soon
+// as it is counted; files and chunks found there from an earlier run with the
+// same inputs and options are loaded instead of counted. Must be called before
+// any sample is added, and cannot be combined with config->approx,
+// config->sharedtable or config->perfecthash.
+int smr_counter_set_checkpoint(SmrCounter *counter, const char *dirname);
+
+// Count only the molecules listed in `filename`, one ID per line (anything
+// after the first space or tab is ignored), and report them all, in the order
+// listed; must be called before any sample is added. Cannot be combined with
+// config->normalize, whose reads per million are of the whole file.
+int smr_counter_set_ids(SmrCounter *counter, const char *filename);
+
+// Count only the reads mapped to the `n` molecules in `molids`, and report
+// them all, in the order listed, as smr_counter_set_ids() does. In a BAM file
+// with a .bai index (FILE.bam.bai or FILE.bai), only the BGZF blocks that the
+// index gives for these molecules are read and decompressed; other files are
+// read in full. Must be called before any sample is added, and cannot be
+// combined with smr_counter_set_ids() or config->normalize.
+int smr_counter_set_regions(SmrCounter *counter, const char *const *molids,
+                            unsigned n);
+
+// Count reads against the reference index built by smr_index_build() in
+// `filename`, which is mapped read-only and shared by every sample; reads
+// mapped to indexed molecules are counted in dense arrays, and their lengths
+// are used for RPKM when no @SQ line gives one. Must be called before any
+// sample is added, and cannot be combined with config->approx or
+// config->perfecthash.
+int smr_counter_set_index(SmrCounter *counter, const char *filename);
+
+// Compile the molecule IDs listed in `numfiles` files into a reference index
+// at `outfile`; see ReferenceIndex. A file starting with '@' is read as SAM,
+// and its @SQ header lines give the IDs and lengths; any other file lists one
+// ID per line, optionally followed by a space or tab and its length (as in a
+// FASTA .fai index). Repeated IDs keep their first entry. Returns -1, with
+// errno set, if a file cannot be read or written.
+int smr_index_build(const char *outfile, const char *const *infiles,
+                    unsigned numfiles);
+
+// An engine keeps a worker pool of `numthreads` threads warm across
+// counters, and the set of molecule IDs counted so far, whose size presizes
+// the tables of later counters; see SmrEngine. A warm counter runs on the
+// engine's threads, whatever config->numthreads says. Counters must be freed
+// before their engine.
+SmrEngine *smr_engine_new(unsigned numthreads);
+void smr_engine_free(SmrEngine *engine);
+size_t smr_engine_dictionary_size(SmrEngine *engine);
+SmrCounter *smr_counter_new_warm(SmrEngine *engine, const SmrConfig *config);
+
+// Open `filename` for writing BGZF (blocked gzip) output, compressed on
+// `numthreads` threads; see BgzfWriter. fclose() finishes the file. Returns
+// NULL if the file cannot be created.
+FILE *smr_bgzf_open(const char *filename, unsigned numthreads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,163 @@
+/*
+
+Copyright (c) 2013, Daniel S. Standage <daniel.standage@gmail.com>
+
+Permission to use, copy, modify, and/or distribute this software for any
+purpose with or without fee is hereby granted, provided that the above
+copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+*/
+
+#ifndef SMR_WORKSTEALING_HPP
+#define SMR_WORKSTEALING_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+/**
+ * @type WorkStealingPool
+ *
+ * Runs sets of tasks on `numthreads` threads, which are started once and
+ * kept waiting between calls to run(), so a long-lived pool pays for thread
+ * startup only once. The tasks of each run are dealt round-robin to one deque
+ * per thread, in the order given. Each thread takes tasks from the front of
+ * its own deque; once that is empty, it steals from the back of the other
+ * threads' deques, so no thread sits idle while another still has work
+ * queued. Callers should order tasks from largest to smallest, so that owners
+ * start on their biggest tasks and thieves take the smallest.
+ *
+ * run() blocks until every task is done. Concurrent calls are run one after
+ * the other.
+ */
+typedef struct WorkStealingPool WorkStealingPool;
+struct WorkStealingPool
+{
+  struct Queue
+  {
+    std::mutex lock;
+    std::deque<size_t> tasks;
+  };
+
+  unsigned numthreads;
+  std::unique_ptr<Queue[]> queues;
+  std::vector<std::thread> threads;
+  std::mutex runlock;
+  std::mutex lock;
+  std::condition_variable wake;
+  std::condition_variable done;
+  const std::function<void(size_t)> *job;
+  unsigned long generation;
+  unsigned active;
+  bool stopping;
+
+  WorkStealingPool(unsigned numthreads)
+    : numthreads(numthreads), queues(new Queue[numthreads]), job(NULL),
+      generation(0), active(0), stopping(false)
+  {
+    for(unsigned i = 0; i < numthreads; i++)
+      threads.emplace_back(&WorkStealingPool::work, this, i);
+  }
+
+  ~WorkStealingPool()
+  {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+    }
+    wake.notify_all();
+    for(auto& thread : threads)
+      thread.join();
+  }
+
+  template<typename Task, typename Func>
+  void run(const std::vector<Task>& tasks, Func func)
+  {
+    std::function<void(size_t)> call = [&tasks, &func](size_t i) {
+      Task task = tasks[i];
+      func(task);
+    };
+
+    std::lock_guard<std::mutex> runguard(runlock);
+    for(size_t i = 0; i < tasks.size(); i++)
+      queues[i % numthreads].tasks.push_back(i);
+
+    std::unique_lock<std::mutex> guard(lock);
+    job = &call;
+    generation++;
+    active = numthreads;
+    wake.notify_all();
+    done.wait(guard, [this]() { return active == 0; });
+    job = NULL;
+  }
+
+  void work(unsigned i)
+  {
+    unsigned long seen = 0;
+    while(true)
+    {
+      const std::function<void(size_t)> *call;
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        wake.wait(guard, [this, seen]() {
+          return stopping || generation != seen;
+        });
+        if(stopping)
+          return;
+        seen = generation;
+        call = job;
+      }
+
+      size_t task;
+      while(pop(i, task) || steal(i, task))
+        (*call)(task);
+
+      std::lock_guard<std::mutex> guard(lock);
+      if(--active == 0)
+        done.notify_one();
+    }
+  }
+
+  bool pop(unsigned owner, size_t& task)
+  {
+    Queue& queue = queues[owner];
+    std::lock_guard<std::mutex> guard(queue.lock);
+    if(queue.tasks.empty())
+      return false;
+    task = queue.tasks.front();
+    queue.tasks.pop_front();
+    return true;
+  }
+
+  // Tasks are never added while a run is in progress, so a thread that finds
+  // every deque empty is done with the run.
+  bool steal(unsigned thief, size_t& task)
+  {
+    for(unsigned i = 1; i < numthreads; i++)
+    {
+      Queue& queue = queues[(thief + i) % numthreads];
+      std::lock_guard<std::mutex> guard(queue.lock);
+      if(queue.tasks.empty())
+        continue;
+      task = queue.tasks.back();
+      queue.tasks.pop_back();
+      return true;
+    }
+    return false;
+  }
+};
+
+#endif